@@ -0,0 +1,30 @@
+#!/bin/bash
+#
+# Compare the throughput of two lumberjack builds with bench/run.sh, writing both runs and the
+# gain of the second over the first in each mode to bench_compare_output.txt.
+#
+# Usage: bench/compare.sh BASELINE CANDIDATE  (bench/run.sh's environment applies)
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+OUTPUT="$ROOT/bench_compare_output.txt"
+BASELINE=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+CANDIDATE=$(cd "$(dirname "$2")" && pwd)/$(basename "$2")
+
+LUMBERJACK="$BASELINE" BENCH_OUTPUT="$OUTPUT.baseline" "$ROOT/bench/run.sh" > /dev/null
+LUMBERJACK="$CANDIDATE" BENCH_OUTPUT="$OUTPUT.candidate" "$ROOT/bench/run.sh" > /dev/null
+
+# Join the runs by name on MB/s and CPU seconds per GB
+awk -v baseline="$(basename "$1")" -v candidate="$(basename "$2")" '
+  function field(line, key) {
+    match(line, "\"" key "\":(\"[^\"]*\"|[^,}]*)")
+    return substr(line, RSTART + length(key) + 3, RLENGTH - length(key) - 3)
+  }
+  FNR == NR { mb[field($0, "name")] = field($0, "mb_per_s"); cpu[field($0, "name")] = field($0, "cpu_s_per_gb"); next }
+  {
+    name = field($0, "name"); m = field($0, "mb_per_s"); c = field($0, "cpu_s_per_gb")
+    printf "{\"name\":%s,\"%s_mb_per_s\":%s,\"%s_mb_per_s\":%s,\"gain_pct\":%.1f,\"cpu_saved_pct\":%.1f}\n",
+           name, baseline, mb[name], candidate, m, (m / mb[name] - 1) * 100, (c > 0 && cpu[name] > 0) ? (1 - c / cpu[name]) * 100 : 0
+  }' "$OUTPUT.baseline" "$OUTPUT.candidate" | tee "$OUTPUT"
+rm -f "$OUTPUT.baseline" "$OUTPUT.candidate"
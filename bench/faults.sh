@@ -0,0 +1,65 @@
+#!/bin/bash
+#
+# Backpressure and data loss of lumberjack under each injected disk fault.
+#
+# A bursty synthetic stream is recorded once, then replayed at its recorded pace into a
+# lumberjack built with -DLUMBERJACK_FAULTS, once per fault.  Writes one JSON object per fault
+# to stdout and to bench_faults_output.txt: how long the producer blocked on the pipe, how far
+# it fell behind, the lines that never reached a log file, write errors and the exit status.
+#
+# Environment: BENCH_LINES (default 500000), BENCH_DIR (scratch directory, default a new one
+# under /tmp).
+
+set -e
+
+BENCH_LINES=${BENCH_LINES:-500000}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+LUMBERJACK="$ROOT/lumberjack"
+FAULTY="$ROOT/lumberjack-faults"
+GEN="$ROOT/bench/gen"
+OUTPUT="$ROOT/bench_faults_output.txt"
+DIR=${BENCH_DIR:-$(mktemp -d /tmp/lumberjack-faults.XXXXXX)}
+TRACE="$DIR/input.ljr"
+
+mkdir -p "$DIR"
+"$GEN" -n "$BENCH_LINES" -b 10000:2000 | "$LUMBERJACK" record -t "$TRACE" > /dev/null
+: > "$OUTPUT"
+
+# Replay the trace into lumberjack with the given faults, and report
+run() {
+  local name=$1 faults=$2 status lines errors
+
+  rm -rf "$DIR/out" && mkdir "$DIR/out"
+  set +e
+  (cd "$DIR/out" && "$LUMBERJACK" replay "$TRACE" 2> replay.err |
+     LUMBERJACK_FAULTS="$faults" "$FAULTY" -f out.log -l 10000 -n 1000 -M metrics.prom 2> lumberjack.err)
+  status=$?
+  set -e
+  lines=$(cat "$DIR"/out/out.log* 2> /dev/null | wc -l)
+  errors=$(awk '/^lumberjack_write_errors_total / { print $2 }' "$DIR/out/metrics.prom" 2> /dev/null || true)
+
+  awk -v name="$name" -v faults="$faults" -v status="$status" -v sent="$BENCH_LINES" -v lines="$lines" \
+      -v errors="${errors:-0}" '
+    /^Replayed/ { match($0, /at most [0-9.]+ s behind/); lag = substr($0, RSTART + 8, RLENGTH - 17) }
+    /^Blocked/ { blocked = $4; stalls = $9 }
+    /^Write latency/ { p99 = $7; max = $13 }
+    END {
+      printf "{\"name\":\"%s\",\"faults\":\"%s\",\"exit\":%d,\"blocked_s\":%s,\"stalled_writes\":%s,", name, faults,
+             status, blocked, stalls
+      printf "\"write_p99_s\":%s,\"write_max_s\":%s,\"max_lag_s\":%s,", p99, max, lag
+      printf "\"lines_lost\":%d,\"write_errors\":%d}\n", sent - lines, errors
+    }' "$DIR/out/replay.err" | tee -a "$OUTPUT"
+}
+
+run "no faults" ""
+run "slow disk" "delay=500"
+run "stalls" "stall=0.01:100000"
+run "torn writes" "short=0.001"
+run "ENOSPC" "enospc=0.001"
+run "EIO" "eio=0.001"
+run "rename failures" "rename=0.01"
+run "open failures" "open=0.05"
+
+if [ -z "$BENCH_DIR" ]; then
+  rm -rf "$DIR"
+fi
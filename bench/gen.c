@@ -0,0 +1,180 @@
+/*
+ * Synthetic log line generator for benchmarking lumberjack.
+ *
+ * Lines look like typical service logs (a level, logfmt fields and free text), with lengths
+ * drawn from a configurable distribution and an optional burst pattern, and are exactly
+ * reproducible for a given seed.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+#define MAX_LINE_LENGTH    (1 << 16)
+
+enum length_dist {
+  LENGTH_FIXED = 0,
+  LENGTH_UNIFORM,   /* between half and one and a half times the mean */
+  LENGTH_EXP        /* exponential, so mostly short lines with a long tail */
+};
+
+void print_usage(const char* name) {
+  fprintf(stderr, "Usage: %s [OPTION]...\n", name);
+  fprintf(stderr, "Write synthetic log lines to stdout.\n\n");
+  fprintf(stderr, "  -b LINES:USEC write bursts of LINES lines, pausing USEC microseconds between them\n");
+  fprintf(stderr, "  -d DIST       line length distribution: 'fixed', 'uniform' (default) or 'exp'\n");
+  fprintf(stderr, "  -h            print this usage and exit\n");
+  fprintf(stderr, "  -m LENGTH     mean line length (default is 100)\n");
+  fprintf(stderr, "  -n LINES      number of lines (default is 1000000)\n");
+  fprintf(stderr, "  -s SEED       random seed (default is 1)\n");
+}
+
+/* xorshift64*, for output that is the same everywhere */
+unsigned long long next_random(unsigned long long* state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+/* Uniform in [0, 1) */
+double next_unit(unsigned long long* state) {
+  return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+size_t next_length(enum length_dist dist, size_t mean, unsigned long long* state) {
+  double u = next_unit(state);
+  double len = mean;
+
+  switch (dist) {
+    case LENGTH_FIXED:
+      break;
+    case LENGTH_UNIFORM:
+      len = mean * (0.5 + u);
+      break;
+    case LENGTH_EXP:
+      len = -(double)mean * log(1.0 - u);
+      break;
+  }
+  if (len < 1) {
+    len = 1;
+  }
+  if (len > MAX_LINE_LENGTH - 1) {
+    len = MAX_LINE_LENGTH - 1;
+  }
+  return (size_t)len;
+}
+
+/* Fill line with len bytes of log-like text */
+void make_line(char* line, size_t len, unsigned long long n, unsigned long long* state) {
+  static const char* levels[] = {"INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR"};
+  static const char* words[] = {"request", "handled", "user", "session", "cache", "miss", "db", "query",
+                                "timeout", "retry", "upstream", "ok", "failed", "queue", "worker", "batch"};
+  char head[128];
+  size_t i = 0, head_len = 0;
+
+  head_len = snprintf(head, sizeof(head), "%s service=api request_id=%llu latency=%llums path=/v1/items/%llu ",
+                      levels[next_random(state) % 6], n, next_random(state) % 1000, next_random(state) % 100000);
+  for (i = 0; i < len && i < head_len; i++) {
+    line[i] = head[i];
+  }
+  while (i < len) {
+    const char* word = words[next_random(state) % 16];
+    size_t word_len = strlen(word);
+    if (word_len > len - i) {
+      word_len = len - i;
+    }
+    memcpy(line + i, word, word_len);
+    i += word_len;
+    if (i < len) {
+      line[i++] = ' ';
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  unsigned long long lines = 1000000, seed = 1, state = 0, n = 0;
+  unsigned long long burst_lines = 0, burst_usec = 0;
+  enum length_dist dist = LENGTH_UNIFORM;
+  size_t mean = 100;
+  char* line = NULL;
+  int c = 0;
+
+  while ((c = getopt(argc, argv, "b:d:hm:n:s:")) != -1) {
+    switch (c) {
+      case 'b':
+        if (sscanf(optarg, "%llu:%llu", &burst_lines, &burst_usec) != 2 || burst_lines == 0) {
+          print_usage(argv[0]);
+          return 1;
+        }
+        break;
+
+      case 'd':
+        if (strcmp(optarg, "fixed") == 0) {
+          dist = LENGTH_FIXED;
+        } else if (strcmp(optarg, "uniform") == 0) {
+          dist = LENGTH_UNIFORM;
+        } else if (strcmp(optarg, "exp") == 0) {
+          dist = LENGTH_EXP;
+        } else {
+          print_usage(argv[0]);
+          return 1;
+        }
+        break;
+
+      case 'h':
+        print_usage(argv[0]);
+        return 0;
+
+      case 'm':
+        mean = strtoul(optarg, NULL, 10);
+        break;
+
+      case 'n':
+        lines = strtoull(optarg, NULL, 10);
+        break;
+
+      case 's':
+        seed = strtoull(optarg, NULL, 10);
+        break;
+
+      default:
+        print_usage(argv[0]);
+        return 1;
+    }
+  }
+  if (mean == 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  line = malloc(MAX_LINE_LENGTH);
+  if (!line) {
+    fprintf(stderr, "Error: Failed to allocate line buffer\n");
+    return 1;
+  }
+  setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+  state = seed * 0x9E3779B97F4A7C15ULL + 1;
+
+  for (n = 0; n < lines; n++) {
+    size_t len = next_length(dist, mean, &state);
+    make_line(line, len, n, &state);
+    line[len] = '\n';
+    if (fwrite(line, 1, len + 1, stdout) != len + 1) {
+      break;
+    }
+
+    /* Hand over each burst at once, then pause */
+    if (burst_lines && (n + 1) % burst_lines == 0) {
+      struct timespec pause = {burst_usec / 1000000, (burst_usec % 1000000) * 1000};
+      fflush(stdout);
+      nanosleep(&pause, NULL);
+    }
+  }
+  free(line);
+  return fflush(stdout) != 0 || ferror(stdout) ? 1 : 0;
+}
@@ -0,0 +1,493 @@
+/*
+ * Microbenchmarks of lumberjack's hot kernels.
+ *
+ * lumberjack.c is compiled in directly (without its main()), so the kernels measured are
+ * exactly those of the logger.  Byte kernels are run over log-like text of several sizes and
+ * reported in GB/s, item kernels in ns per call; each is warmed up, then timed over repeated
+ * samples, reporting the minimum, median and 90th percentile.  The scans dispatched by CPU
+ * level are timed at each level the CPU supports, and `make microbench` also runs a build with
+ * the SSE2 paths compiled out, for comparing all the variants.
+ *
+ * It is linked with the allocator wrapped (-Wl,--wrap=malloc and so on), to check that field
+ * extraction makes no heap allocations once warmed up, failing if it does.
+ */
+
+#define LUMBERJACK_NO_MAIN
+#include "../lumberjack.c"
+
+#define MICRO_MAX_SIZE      (1 << 20)
+#define MICRO_SAMPLES       (21)
+#define MICRO_WARMUP        (3)
+#define MICRO_SAMPLE_NS     (1000000) /* minimum length of each sample */
+#define MICRO_ITEMS         (1024)    /* calls per repetition of item kernels */
+#define MICRO_FIELD_WARMUP  (16)      /* passes over the input before counting allocations */
+#define MICRO_FIELD_PASSES  (64)
+
+/* Results are accumulated here so no kernel is optimized away */
+volatile size_t micro_sink = 0;
+
+/* Heap allocations made by lumberjack's code, counted by the wrapped allocator */
+unsigned long micro_allocations = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* p, size_t size);
+int __real_posix_memalign(void** p, size_t alignment, size_t size);
+
+void* __wrap_malloc(size_t size) {
+  __atomic_add_fetch(&micro_allocations, 1, __ATOMIC_RELAXED);
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+  __atomic_add_fetch(&micro_allocations, 1, __ATOMIC_RELAXED);
+  return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* p, size_t size) {
+  __atomic_add_fetch(&micro_allocations, 1, __ATOMIC_RELAXED);
+  return __real_realloc(p, size);
+}
+
+int __wrap_posix_memalign(void** p, size_t alignment, size_t size) {
+  __atomic_add_fetch(&micro_allocations, 1, __ATOMIC_RELAXED);
+  return __real_posix_memalign(p, alignment, size);
+}
+
+/* A kernel over len bytes of in, with room for the largest expansion in out */
+typedef size_t (*byte_kernel)(const char* in, size_t len, char* out);
+
+/* A kernel called once for item i of MICRO_ITEMS, writing to out */
+typedef size_t (*item_kernel)(size_t i, char* out);
+
+size_t kernel_memchr_lines(const char* in, size_t len, char* out) {
+  const char* end = in + len;
+  size_t lines = 0;
+  (void)out;
+  while ((in = memchr(in, '\n', end - in)) != NULL) {
+    in++;
+    lines++;
+  }
+  return lines;
+}
+
+size_t kernel_reverse_lines(const char* in, size_t len, char* out) {
+  size_t lines = 0, nl = 0;
+  (void)out;
+  while ((nl = find_last_newline(in, len)) != len) {
+    len = nl;
+    lines++;
+  }
+  return lines;
+}
+
+size_t kernel_find_control(const char* in, size_t len, char* out) {
+  (void)out;
+  return find_control(in, len);
+}
+
+size_t kernel_sanitize(const char* in, size_t len, char* out) {
+  enum sanitize_state state = SANITIZE_TEXT;
+  return sanitize_block(&state, in, len, out);
+}
+
+size_t kernel_utf8_valid(const char* in, size_t len, char* out) {
+  (void)out;
+  return utf8_valid_prefix(in, len);
+}
+
+/* Count the bytes needing escapes, as json_escape() finds them */
+size_t kernel_find_json_escape(const char* in, size_t len, char* out) {
+  size_t i = 0, escapes = 0;
+  (void)out;
+  while ((i += find_json_escape(in + i, len - i)) < len) {
+    i++;
+    escapes++;
+  }
+  return escapes;
+}
+
+size_t kernel_json_escape(const char* in, size_t len, char* out) {
+  return json_escape(in, len, out);
+}
+
+size_t kernel_hash(const char* in, size_t len, char* out) {
+  (void)out;
+  return (size_t)hash_bytes(in, len);
+}
+
+#ifdef HAVE_ZLIB
+size_t kernel_adler32(const char* in, size_t len, char* out) {
+  (void)out;
+  return adler32(1, (const Bytef*)in, len);
+}
+#endif
+
+/* The lines of a block indexed, stamped and rendered in passes, as the prefixed variants of the
+ * main loop do with -B 1000 -p '[%d] %n: ', over the line batch's parallel arrays and over a
+ * naive array of per-line structs */
+struct prefix_template micro_batched;
+struct prefix_values micro_batch_values;
+int micro_batch_check = 0;
+struct line_batch micro_batch;
+
+struct micro_line {
+  const char* start;
+  size_t len;
+  unsigned int end;
+  unsigned char flags;
+  struct prefix_values values;
+};
+struct micro_line micro_lines[LINE_BATCH_LINES];
+
+size_t kernel_line_batch(const char* in, size_t len, char* out) {
+  size_t used = 0, total = 0;
+
+  while ((used = line_batch_index(&micro_batch, in, len, LINE_BATCH_LINES)) > 0) {
+    size_t i = 0, out_len = 0;
+    unsigned long long batch = micro_batch_values.batch;
+
+    line_batch_stamp(&micro_batch, &micro_batched, &micro_batch_values, &micro_batch_check, 1000);
+    micro_batch_values.batch = batch;
+    while (i < micro_batch.count) {
+      i = line_batch_render(&micro_batch, i, in, &micro_batched, &micro_batch_values, out, LINE_BATCH_OUT_SIZE, &out_len);
+      total += out_len;
+    }
+    in += used;
+    len -= used;
+  }
+  return total;
+}
+
+size_t kernel_line_structs(const char* in, size_t len, char* out) {
+  const char* end = in + len;
+  const char* nl = NULL;
+  size_t total = 0;
+
+  while (in < end) {
+    size_t count = 0, i = 0, o = 0;
+
+    /* Index */
+    while (count < LINE_BATCH_LINES && (nl = memchr(in, '\n', end - in)) != NULL) {
+      micro_lines[count].start = in;
+      micro_lines[count].len = nl + 1 - in;
+      in = nl + 1;
+      count++;
+    }
+    if (count == 0) {
+      break;
+    }
+
+    /* Stamp */
+    for (i = 0; i < count; i++) {
+      struct timespec last = micro_batch_values.monotonic;
+      prefix_sample_batch(&micro_batched, &micro_batch_values, &micro_batch_check, 1000);
+      micro_lines[i].flags = (micro_batch_values.monotonic.tv_sec != last.tv_sec ||
+                              micro_batch_values.monotonic.tv_nsec != last.tv_nsec);
+      micro_batch_values.seq++;
+      micro_batch_values.line++;
+      micro_lines[i].values = micro_batch_values;
+      micro_batch_values.batch++;
+    }
+
+    /* Render */
+    for (i = 0; i < count; i++) {
+      if (o + MAX_PREFIX_RENDERED_LENGTH + micro_lines[i].len > LINE_BATCH_OUT_SIZE) {
+        total += o;
+        o = 0;
+      }
+      if (micro_lines[i].flags) {
+        micro_batched.cache_valid = 0;
+      }
+      o += prefix_render(&micro_batched, &micro_lines[i].values, out + o);
+      memcpy(out + o, micro_lines[i].start, micro_lines[i].len);
+      o += micro_lines[i].len;
+      micro_lines[i].end = o;
+    }
+    total += o;
+  }
+  return total;
+}
+
+/* Item kernels, over values and times that vary like a real stream */
+unsigned long long micro_values[MICRO_ITEMS];
+struct prefix_template micro_datetime, micro_json;
+struct prefix_values micro_times[MICRO_ITEMS];
+
+size_t kernel_put_uint(size_t i, char* out) {
+  return put_uint(out, micro_values[i]) - out;
+}
+
+size_t kernel_snprintf_uint(size_t i, char* out) {
+  return snprintf(out, 32, "%llu", micro_values[i]);
+}
+
+/* The -d stamp of binary records, rendered with snprintf() when read back */
+size_t kernel_render_stamp(size_t i, char* out) {
+  return render_stamp(STAMP_DATETIME, micro_times[i].realtime.tv_sec * 1000000LL + micro_times[i].realtime.tv_nsec / 1000, out);
+}
+
+/* The -d stamp built with localtime_r() and strftime() per line, as a baseline */
+size_t kernel_strftime_stamp(size_t i, char* out) {
+  struct tm tm;
+  size_t n = 0;
+  localtime_r(&micro_times[i].realtime.tv_sec, &tm);
+  n = strftime(out, MAX_TIMESTAMP_LENGTH, "[%Y-%m-%d %H:%M:%S", &tm);
+  return n + snprintf(out + n, MAX_TIMESTAMP_LENGTH - n, ".%06ld]: ", micro_times[i].realtime.tv_nsec / 1000);
+}
+
+size_t kernel_prefix_datetime(size_t i, char* out) {
+  return prefix_render(&micro_datetime, &micro_times[i], out);
+}
+
+size_t kernel_prefix_json(size_t i, char* out) {
+  return prefix_render(&micro_json, &micro_times[i], out);
+}
+
+int compare_double(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+/* Time MICRO_SAMPLES samples of reps calls of run(), after warming up, returning sorted ns
+ * per repetition in samples */
+void micro_measure(void (*run)(void* arg, size_t reps), void* arg, double* samples) {
+  size_t reps = 1;
+  int i = 0;
+
+  /* Find a repetition count long enough to time accurately */
+  for (;;) {
+    long long start = monotonic_ns();
+    run(arg, reps);
+    if (monotonic_ns() - start >= MICRO_SAMPLE_NS) {
+      break;
+    }
+    reps *= 2;
+  }
+  for (i = 0; i < MICRO_WARMUP; i++) {
+    run(arg, reps);
+  }
+  for (i = 0; i < MICRO_SAMPLES; i++) {
+    long long start = monotonic_ns();
+    run(arg, reps);
+    samples[i] = (double)(monotonic_ns() - start) / reps;
+  }
+  qsort(samples, MICRO_SAMPLES, sizeof(double), compare_double);
+}
+
+struct byte_run {
+  byte_kernel kernel;
+  const char* in;
+  size_t len;
+  char* out;
+};
+
+void run_bytes(void* arg, size_t reps) {
+  struct byte_run* r = arg;
+  size_t i = 0, sink = 0;
+  for (i = 0; i < reps; i++) {
+    sink += r->kernel(r->in, r->len, r->out);
+  }
+  micro_sink += sink;
+}
+
+struct item_run {
+  item_kernel kernel;
+  char* out;
+};
+
+void run_items(void* arg, size_t reps) {
+  struct item_run* r = arg;
+  size_t i = 0, j = 0, sink = 0;
+  for (i = 0; i < reps; i++) {
+    for (j = 0; j < MICRO_ITEMS; j++) {
+      sink += r->kernel(j, r->out);
+    }
+  }
+  micro_sink += sink;
+}
+
+/* Fill buf with lines of log-like text, with quotes and backslashes as in JSON payloads */
+void micro_input(char* buf, size_t size) {
+  static const char* words[] = {"INFO", "service=api", "request_id=1234567", "latency=42ms", "path=/v1/items/9",
+                                "user", "\"quoted\"", "cache", "miss", "db", "query", "timeout", "upstream"};
+  unsigned long long state = 1;
+  size_t i = 0, words_on_line = 0;
+
+  while (i < size) {
+    const char* word = NULL;
+    size_t n = 0;
+
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    word = words[(state >> 33) % 13];
+    n = strlen(word);
+    if (i + n + 1 > size) {
+      break;
+    }
+    memcpy(buf + i, word, n);
+    i += n;
+    buf[i++] = (++words_on_line % 12 == 0) ? '\n' : ' ';
+  }
+  memset(buf + i, '\n', size - i);
+}
+
+/* Run the input through logfmt field extraction, rotating after each pass and waiting for the
+ * extraction to catch up, into a scratch directory.  Returns the heap allocations made after the warmup passes, or -1 on failure. */
+long micro_field_allocations(const char* in, size_t len, int huge_pages) {
+  struct field_extractor ex = {0};
+  char dir[] = "/tmp/lumberjack-micro.XXXXXX";
+  char name[MAX_FILENAME_LENGTH];
+  unsigned long start = 0;
+  int pass = 0;
+
+  if (!mkdtemp(dir)) {
+    return -1;
+  }
+  snprintf(name, sizeof(name), "%s/micro.log", dir);
+  ex.format = FIELDS_LOGFMT;
+  ex.filename = name;
+  ex.max_files = 1;
+  ex.huge_pages = huge_pages;
+  if (field_start(&ex, 0, 0) != 0) {
+    return -1;
+  }
+
+  for (pass = 0; pass < MICRO_FIELD_WARMUP + MICRO_FIELD_PASSES; pass++) {
+    const char* line = in;
+    const char* end = in + len;
+    const char* nl = NULL;
+
+    if (pass == MICRO_FIELD_WARMUP) {
+      start = __atomic_load_n(&micro_allocations, __ATOMIC_RELAXED);
+    }
+    while ((nl = memchr(line, '\n', end - line)) != NULL) {
+      field_append(&ex, line, nl + 1 - line, 1);
+      line = nl + 1;
+    }
+    field_rotate(&ex);
+
+    /* Let the extraction thread catch up, so no lines are dropped */
+    for (;;) {
+      int queued = 0;
+      pthread_mutex_lock(&ex.lock);
+      queued = ex.queue_length;
+      pthread_mutex_unlock(&ex.lock);
+      if (!queued) {
+        break;
+      }
+      usleep(1000);
+    }
+  }
+  field_stop(&ex);
+
+  snprintf(name, sizeof(name), "%s/micro.log%s", dir, FIELDS_SUFFIX);
+  unlink(name);
+  rmdir(dir);
+  return __atomic_load_n(&micro_allocations, __ATOMIC_RELAXED) - start;
+}
+
+int main(void) {
+  static const size_t sizes[] = {64, 1024, 64 * 1024, MICRO_MAX_SIZE};
+  /* Kernels built on the dispatched scans are timed at every level the CPU supports */
+  static const struct { const char* name; byte_kernel kernel; int dispatched; } byte_kernels[] = {
+    {"memchr line count", kernel_memchr_lines, 0},
+    {"reverse line count", kernel_reverse_lines, 1},
+    {"find_control", kernel_find_control, 1},
+    {"sanitize_block", kernel_sanitize, 1},
+    {"utf8_valid_prefix", kernel_utf8_valid, 1},
+    {"find_json_escape", kernel_find_json_escape, 1},
+    {"json_escape", kernel_json_escape, 1},
+    {"line batch (arrays)", kernel_line_batch, 0},
+    {"line batch (structs)", kernel_line_structs, 0},
+    {"hash_bytes (FNV-1a)", kernel_hash, 0},
+#ifdef HAVE_ZLIB
+    {"adler32 (archives)", kernel_adler32, 0},
+#endif
+  };
+  static const struct { const char* name; item_kernel kernel; } item_kernels[] = {
+    {"put_uint", kernel_put_uint},
+    {"snprintf %llu", kernel_snprintf_uint},
+    {"render_stamp", kernel_render_stamp},
+    {"strftime stamp", kernel_strftime_stamp},
+    {"prefix_render [%d]: ", kernel_prefix_datetime},
+    {"prefix_render JSON", kernel_prefix_json},
+  };
+  double samples[MICRO_SAMPLES];
+  long allocations = 0;
+  char* in = malloc(MICRO_MAX_SIZE);
+  char* out = malloc(MAX_JSON_EXPANSION * MICRO_MAX_SIZE);
+  unsigned long long state = 1;
+  size_t i = 0, j = 0;
+  int level = 0;
+
+  if (!in || !out) {
+    eprint(0, "Failed to allocate buffers%s", "");
+    return 1;
+  }
+  micro_input(in, MICRO_MAX_SIZE);
+
+  /* Values of all lengths, and times a few lines per millisecond apart */
+  clock_gettime(CLOCK_REALTIME, &micro_times[0].realtime);
+  for (i = 0; i < MICRO_ITEMS; i++) {
+    long long ns = micro_times[0].realtime.tv_sec * 1000000000LL + micro_times[0].realtime.tv_nsec + i * 300000LL;
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    micro_values[i] = state >> (state % 64);
+    micro_times[i].realtime.tv_sec = ns / 1000000000;
+    micro_times[i].realtime.tv_nsec = ns % 1000000000;
+    micro_times[i].monotonic = micro_times[i].realtime;
+    micro_times[i].seq = i + 1;
+    micro_times[i].line = i + 1;
+  }
+  prefix_compile(&micro_datetime, "[%d]: ", "bench");
+  prefix_compile(&micro_json, "{\"ts\":%e,\"seq\":%s,\"src\":\"bench\",\"msg\":\"", "bench");
+  prefix_compile(&micro_batched, "[%d] %n: ", "bench");
+  micro_batched.batched = 1;
+  prefix_sample(&micro_batched, &micro_batch_values);
+
+#ifdef __SSE2__
+  printf("Build: SSE2, CPU: %s\n\n", cpu_level_names[cpu_detect()]);
+#else
+  printf("Build: scalar, CPU: %s\n\n", cpu_level_names[cpu_detect()]);
+#endif
+
+  /* Throughput at the fastest, median and 90th percentile sample times */
+  printf("%-22s %-8s %9s %10s %10s %10s\n", "kernel", "level", "bytes", "GB/s best", "GB/s med", "GB/s p90");
+  for (i = 0; i < sizeof(byte_kernels) / sizeof(byte_kernels[0]); i++) {
+    for (level = 0; level <= (int)(byte_kernels[i].dispatched ? cpu_detect() : CPU_BASELINE); level++) {
+      cpu_dispatch((enum cpu_level)level);
+      for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+        struct byte_run r = {byte_kernels[i].kernel, in, sizes[j], out};
+        micro_measure(run_bytes, &r, samples);
+        printf("%-22s %-8s %9zu %10.2f %10.2f %10.2f\n", byte_kernels[i].name, cpu_level_names[level], sizes[j],
+               sizes[j] / samples[0], sizes[j] / samples[MICRO_SAMPLES / 2],
+               sizes[j] / samples[MICRO_SAMPLES * 9 / 10]);
+      }
+    }
+  }
+  cpu_dispatch(cpu_default(cpu_detect()));
+
+  printf("\n%-22s %10s %10s %10s\n", "kernel", "ns best", "ns med", "ns p90");
+  for (i = 0; i < sizeof(item_kernels) / sizeof(item_kernels[0]); i++) {
+    struct item_run r = {item_kernels[i].kernel, out};
+    micro_measure(run_items, &r, samples);
+    printf("%-22s %10.1f %10.1f %10.1f\n", item_kernels[i].name, samples[0] / MICRO_ITEMS,
+           samples[MICRO_SAMPLES / 2] / MICRO_ITEMS, samples[MICRO_SAMPLES * 9 / 10] / MICRO_ITEMS);
+  }
+
+  /* Batches come from a fixed pool and blocks are encoded in place, so once warmed up field
+   * extraction must not allocate, with or without huge pages */
+  printf("\n%-22s %10s\n", "steady state", "allocs");
+  for (i = 0; i < 2; i++) {
+    allocations = micro_field_allocations(in, MICRO_MAX_SIZE, (int)i);
+    printf("%-22s %10ld\n", i ? "field extraction -H" : "field extraction", allocations);
+    if (allocations != 0) {
+      eprint(0, "Field extraction allocated in steady state%s", "");
+      free(in);
+      free(out);
+      return 1;
+    }
+  }
+  free(in);
+  free(out);
+  return 0;
+}
@@ -0,0 +1,78 @@
+#!/bin/bash
+#
+# Throughput benchmark of lumberjack in each mode, against cat and split as baselines.
+#
+# Writes one JSON object per run to stdout and to bench_output.txt: MB/s, lines/s, CPU
+# seconds per GB, and for lumberjack runs the rotation pause percentiles from its metrics.
+#
+# Environment: BENCH_LINES (default 2000000), BENCH_LENGTH (mean line length, default 100),
+# BENCH_DIST (fixed, uniform or exp, default uniform), BENCH_RUNS (best of, default 3),
+# BENCH_DIR (scratch directory, default a new one under /tmp), LUMBERJACK (the build to run,
+# default ./lumberjack), BENCH_OUTPUT (default bench_output.txt).
+
+set -e
+
+BENCH_LINES=${BENCH_LINES:-2000000}
+BENCH_LENGTH=${BENCH_LENGTH:-100}
+BENCH_DIST=${BENCH_DIST:-uniform}
+BENCH_RUNS=${BENCH_RUNS:-3}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+LUMBERJACK=${LUMBERJACK:-$ROOT/lumberjack}
+GEN="$ROOT/bench/gen"
+OUTPUT=${BENCH_OUTPUT:-$ROOT/bench_output.txt}
+DIR=${BENCH_DIR:-$(mktemp -d /tmp/lumberjack-bench.XXXXXX)}
+INPUT="$DIR/input.log"
+
+mkdir -p "$DIR"
+"$GEN" -n "$BENCH_LINES" -m "$BENCH_LENGTH" -d "$BENCH_DIST" > "$INPUT"
+BYTES=$(stat -c %s "$INPUT")
+: > "$OUTPUT"
+
+# Run a command BENCH_RUNS times in an empty output directory, keeping the fastest run, and
+# report it.  For lumberjack, the metrics of that run give the rotation pauses.
+run() {
+  local name=$1 cmd=$2
+  local best_real="" best_cpu="" times real user sys pauses="" i
+
+  for ((i = 0; i < BENCH_RUNS; i++)); do
+    rm -rf "$DIR/out" && mkdir "$DIR/out"
+    times=$( { TIMEFORMAT="%R %U %S"; time { (cd "$DIR/out" && eval "$cmd") > /dev/null 2>&1; }; } 2>&1 )
+    read -r real user sys <<< "$times"
+    if [ -z "$best_real" ] || awk "BEGIN { exit !($real < $best_real) }"; then
+      best_real=$real
+      best_cpu=$(awk "BEGIN { print $user + $sys }")
+      if [ -f "$DIR/out/metrics.prom" ]; then
+        pauses=$(awk -F'[{}" ]+' '/^lumberjack_rotation_pause_seconds\{/ {
+                   printf "%s\"%s\":%s", sep, ($3 == "1" ? "max" : "p" $3 * 100), $4; sep = "," }
+                   /^lumberjack_rotation_pause_seconds_count 0$/ { exit 1 }' \
+                 "$DIR/out/metrics.prom") || pauses=""
+      fi
+    fi
+  done
+
+  awk -v name="$name" -v real="$best_real" -v cpu="$best_cpu" -v bytes="$BYTES" -v lines="$BENCH_LINES" \
+      -v pauses="$pauses" 'BEGIN {
+    if (real <= 0) real = 0.001
+    printf "{\"name\":\"%s\",\"seconds\":%.3f,\"mb_per_s\":%.1f,\"lines_per_s\":%.0f,\"cpu_s_per_gb\":%.3f",
+           name, real, bytes / 1048576 / real, lines / real, cpu / (bytes / 1073741824)
+    if (pauses != "") printf ",\"rotation_pause_s\":{%s}", pauses
+    printf "}\n"
+  }' | tee -a "$OUTPUT"
+}
+
+run "cat" "cat '$INPUT' > out.log"
+run "split -l 10000" "split -l 10000 '$INPUT' out."
+run "plain" "'$LUMBERJACK' -l 0 -M metrics.prom -i '$INPUT'"
+run "plain -l 10000" "'$LUMBERJACK' -M metrics.prom -i '$INPUT'"
+run "-d" "'$LUMBERJACK' -d -l 0 -M metrics.prom -i '$INPUT'"
+run "-t" "'$LUMBERJACK' -t -l 0 -M metrics.prom -i '$INPUT'"
+run "-B 1000 -d" "'$LUMBERJACK' -B 1000 -d -l 0 -M metrics.prom -i '$INPUT'"
+run "-j" "'$LUMBERJACK' -j -l 0 -M metrics.prom -i '$INPUT'"
+run "-b" "'$LUMBERJACK' -b -l 0 -M metrics.prom -i '$INPUT'"
+run "-l 1000 (many rotations)" "'$LUMBERJACK' -l 1000 -M metrics.prom -i '$INPUT'"
+run "-l 1000 -n 1000 (large -n)" "'$LUMBERJACK' -l 1000 -n 1000 -M metrics.prom -i '$INPUT'"
+run "pipe, bursts of 10000 lines" "'$GEN' -n '$BENCH_LINES' -m '$BENCH_LENGTH' -d '$BENCH_DIST' -b 10000:1000 | '$LUMBERJACK' -l 10000 -M metrics.prom"
+
+if [ -z "$BENCH_DIR" ]; then
+  rm -rf "$DIR"
+fi
@@ -0,0 +1,57 @@
+#!/bin/bash
+#
+# Training workload for a profile-guided build: runs the given lumberjack over synthetic input
+# in each of the modes the fleet runs, so its profile covers the same hot paths.
+#
+# Usage: bench/train.sh LUMBERJACK
+
+set -e
+
+LUMBERJACK=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+GEN="$ROOT/bench/gen"
+DIR=$(mktemp -d /tmp/lumberjack-train.XXXXXX)
+
+cd "$DIR"
+"$GEN" -n 300000 -m 120 -d exp > input.log
+
+# Color codes, other control bytes and invalid UTF-8 in some lines, for the filters
+LC_ALL=C awk 'NR % 7 == 0 { $0 = "\033[31m" $0 "\033[0m" }
+              NR % 13 == 0 { $0 = $0 "\b\r" }
+              NR % 11 == 0 { $0 = $0 sprintf(" %c%c", 255, 254) } { print }' input.log > dirty.log
+
+# Plain, stamped and templated
+"$LUMBERJACK" -l 0 -i input.log -f plain.log
+"$LUMBERJACK" -d -l 0 -i input.log -f stamped.log
+"$LUMBERJACK" -t -l 0 -i input.log -f stamped.log
+"$LUMBERJACK" -B 1000 -d -l 0 -i input.log -f stamped.log
+"$LUMBERJACK" -p '%u %h %T[%p] %s: ' -l 0 -i input.log -f templated.log
+"$LUMBERJACK" -E -d -l 0 -i stamped.log -f embedded.log
+
+# Embedded stamps before 1970, which take the time the line arrived
+printf '1969-07-20T20:17:40Z landing\n0000-01-01 00:00:00 year zero\n' > pre-epoch.log
+"$LUMBERJACK" -E -p '%u %e ' -l 0 -i pre-epoch.log -f embedded.log
+"$LUMBERJACK" -E -b -l 0 -i pre-epoch.log -f embedded-binary.log
+"$LUMBERJACK" cat -u embedded-binary.log > /dev/null
+
+# Heavy rotation, with metrics and archives
+"$LUMBERJACK" -l 1000 -n 20 -M metrics.prom -i input.log -f rotated.log
+mkdir -p archive
+"$LUMBERJACK" -l 20000 -n 5 -A archive -i input.log -f archived.log
+
+# Filters
+"$LUMBERJACK" -s -l 0 -i dirty.log -f filtered.log
+"$LUMBERJACK" -u replace -l 0 -i dirty.log -f filtered.log
+"$LUMBERJACK" -s -u escape -l 0 -i dirty.log -f filtered.log
+
+# Structured output and field extraction
+"$LUMBERJACK" -j -d -l 0 -i dirty.log -f json.log
+"$LUMBERJACK" -x logfmt -l 50000 -i input.log -f fields.log
+"$LUMBERJACK" -b -l 0 -i input.log -f binary.log
+"$LUMBERJACK" cat -d binary.log > /dev/null
+
+# Reading logs back
+"$LUMBERJACK" merge rotated.log stamped.log > /dev/null
+"$LUMBERJACK" tac rotated.log > /dev/null
+
+cd / && rm -rf "$DIR"
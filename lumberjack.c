@@ -22,40 +22,422 @@
  * SOFTWARE.
 */
 
+#ifdef LUMBERJACK_FAULTS
+#define _GNU_SOURCE  /* fopencookie() */
+#endif
+
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_DISPATCH  /* AVX2 and AVX-512 kernel variants, chosen at startup */
+#include <immintrin.h>
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#endif
+
 #define DEFAULT_OUTPUT_LOG_FILENAME "log.log"
 #define DEFAULT_MAX_FILES           (10)
 #define DEFAULT_MAX_LINES           (10000)
 #define MAX_FILENAME_LENGTH         (1024)
 #define MAX_TIMESTAMP_LENGTH        (64)
+#define INPUT_BUFFER_SIZE           (64 * 1024)
+#define MAX_SANITIZE_EXPANSION      (4)  /* control byte -> "\\xHH" */
+#define MAX_UTF8_EXPANSION          (4)  /* invalid byte -> "\\xHH" */
+#define MAX_UTF8_PENDING            (3)  /* incomplete sequence bytes held between blocks */
+#define MAX_JSON_EXPANSION          (6)  /* control byte -> "\\u00XX" */
+#define JSON_ESCAPE_CHUNK           (16 * 1024)
+#define MAX_PREFIX_OPS              (32)
+#define MAX_PREFIX_LENGTH           (1024)  /* static text of a prefix template */
+#define MAX_PREFIX_RENDERED_LENGTH  (MAX_PREFIX_LENGTH + MAX_PREFIX_OPS * MAX_TIMESTAMP_LENGTH)
+#define BATCH_CHECK_LINES           (16)  /* lines between checks of the age of a batch clock sample */
+#define LINE_BATCH_LINES            (1024)  /* lines described at a time by a line batch */
+#define LINE_BATCH_OUT_SIZE         (256 * 1024)  /* prefixed lines rendered before writing them */
+#define FIELDS_SUFFIX               ".cols"
+#define FIELD_BATCH_SIZE            (128 * 1024)
+#define FIELD_QUEUE_LENGTH          (64)
+#define FIELD_POOL_LENGTH           (FIELD_QUEUE_LENGTH + 2)  /* queued, being filled and being extracted */
+#define FIELD_BLOCK_ROWS            (4096)
+#define FIELD_ARENA_SIZE            (1024 * 1024)
+#define MAX_FIELD_COLUMNS           (64)
+#define MAX_FIELD_NAME_LENGTH       (64)
+#define CACHE_LINE_SIZE             (64)
+#define HUGE_PAGE_SIZE              (2 * 1024 * 1024)
+#define ARCHIVE_SUFFIX              ".lja"
+#define ARCHIVE_MAGIC               "LJA1"
+#define ARCHIVE_QUEUE_LENGTH        (16)
+#define ARCHIVE_BLOCK_LINES         (16384)
+#define ARCHIVE_BLOCK_BYTES         (16 * 1024 * 1024)  /* column bytes after which a block is written early */
+#define ARCHIVE_MAX_COLUMN_LENGTH   (1024 * 1024 * 1024)  /* largest column of a block read back */
+#define ARCHIVE_MAX_TEMPLATES       (65536)
+#define ARCHIVE_MAX_TEMPLATE_LENGTH (4096)
+#define ARCHIVE_PARAM_MARKER        ('\x01')
+#define ARCHIVE_DEFLATE_LEVEL       (6)
+#define BINARY_MAGIC                "LJB1"
+#define MAX_RECORD_LENGTH           (1024 * 1024)  /* longer lines are split into continuation records */
+#define MERGE_READ_SIZE             (1 << 20)  /* bytes read from each merged file at a time */
+#define MERGE_COMPACT_SIZE          (4 << 20)  /* size of queued lines before reclaiming space */
+#define TAC_BLOCK_SIZE              (1 << 20)  /* bytes read backward from a log file at a time */
+#define RECORD_MAGIC                "LJR1"
+#define REPLAY_STALL_NS             (1000000)  /* writes blocked this long are counted as stalls */
+#define METRICS_INTERVAL            (10)  /* seconds between rewrites of the -M metrics file */
+#define HISTOGRAM_SUB_BITS          (5)
+#define TRACE_MAX_SPANS             (1 << 18)  /* most recent spans kept per thread */
+#define HISTOGRAM_BUCKETS           ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
 
 #define eprint(e, frmt, ...) (e ? fprintf(stderr, "Error %d - %s: "frmt"\n", e, strerror(e), __VA_ARGS__) \
                                 : fprintf(stderr, "Error: "frmt"\n", __VA_ARGS__))
 #define wprint(e, frmt, ...) (e ? fprintf(stderr, "Warning %d - %s: "frmt"\n", e, strerror(e), __VA_ARGS__) \
                                 : fprintf(stderr, "Warning: "frmt"\n", __VA_ARGS__))
 
+/* USDT probes for bpftrace or perf, each a single nop until traced.  Without sys/sdt.h the
+ * arguments are still evaluated (for free) so nothing only used by probes goes unused. */
+#ifdef HAVE_SDT
+#define PROBE1(name, a)       DTRACE_PROBE1(lumberjack, name, a)
+#define PROBE2(name, a, b)    DTRACE_PROBE2(lumberjack, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(lumberjack, name, a, b, c)
+#else
+#define PROBE1(name, a)       ((void)(a))
+#define PROBE2(name, a, b)    ((void)(a), (void)(b))
+#define PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#endif
+
 void print_usage(const char* name) {
   fprintf(stderr, "Usage: <some_binary> 2>&1 | %s [OPTION]...\n", name);
   fprintf(stderr, "       %s [OPTION]...\n", name);
+  fprintf(stderr, "       %s fields FILE%s [KEY]...\n", name, FIELDS_SUFFIX);
+  fprintf(stderr, "       %s cat [-d] [-e] [-q] [-u] FILE...\n", name);
+  fprintf(stderr, "       %s merge [-w USEC] LOG...\n", name);
+  fprintf(stderr, "       %s tac [-n LINES] [-s TIME] LOG...\n", name);
+  fprintf(stderr, "       <some_binary> | %s record [-t] TRACE | %s [OPTION]...\n", name, name);
+  fprintf(stderr, "       %s replay [-s SPEED] TRACE | %s [OPTION]...\n", name, name);
   fprintf(stderr, "Chop log into smaller logs.\n\n");
   fprintf(stderr, "  -a          append existing log output\n");
+  fprintf(stderr, "  -A DIR      convert each retired log file into a compact archive in DIR\n");
+  fprintf(stderr, "  -B USEC     stamp all lines of an input read with one clock sample, no more than USEC old\n");
+  fprintf(stderr, "  -b          write binary records with out-of-band timestamps, read with '%s cat'\n", name);
+  fprintf(stderr, "  -C LEVEL    use the scanning kernels for LEVEL, 'baseline', 'avx2' or 'avx512', instead of\n");
+  fprintf(stderr, "              the best the CPU supports up to 'avx2'\n");
   fprintf(stderr, "  -d          add local datetime stamp at the start of each line\n");
+  fprintf(stderr, "  -D FILE     record spans of each stage and thread, written to FILE on exit as Chrome\n");
+  fprintf(stderr, "              trace-event JSON (for Perfetto)\n");
+  fprintf(stderr, "  -E          take the time of each line from a timestamp already at its start (ISO-8601,\n");
+  fprintf(stderr, "              RFC3339 or epoch), falling back to the time it arrived\n");
   fprintf(stderr, "  -f FILENAME filename to use (default is %s)\n", DEFAULT_OUTPUT_LOG_FILENAME);
   fprintf(stderr, "  -h          print this usage and exit\n");
+  fprintf(stderr, "  -H          back the field extraction batch buffers with huge pages, where available\n");
   fprintf(stderr, "  -i FILENAME read input from provided filename instead of stdin\n");
+  fprintf(stderr, "  -j          write each line as a JSON object: {\"ts\":...,\"seq\":...,\"src\":...,\"msg\":...}\n");
+  fprintf(stderr, "              (invalid UTF-8 is replaced with U+FFFD, unless -u is given)\n");
   fprintf(stderr, "  -l LINES    maximum number of lines per file (default is %d, 0 to disable limit)\n", DEFAULT_MAX_LINES);
+  fprintf(stderr, "  -M FILE     rewrite FILE with metrics in the Prometheus text format every %d seconds\n", METRICS_INTERVAL);
+  fprintf(stderr, "              (metrics are also written to stderr on SIGUSR1)\n");
   fprintf(stderr, "  -n FILES    maximum number of files to maintain (default is %d)\n", DEFAULT_MAX_FILES);
+  fprintf(stderr, "  -p TEMPLATE add a prefix at the start of each line, where TEMPLATE may contain:\n");
+  fprintf(stderr, "                %%d local datetime (as -d)    %%u UTC datetime       %%e epoch seconds\n");
+  fprintf(stderr, "                %%m monotonic seconds (as -t) %%s sequence number    %%n line number in file\n");
+  fprintf(stderr, "                %%h hostname                  %%p process ID         %%T tag (see -T)\n");
+  fprintf(stderr, "                %%b index of the line within its -B batch     %%%% a literal %%\n");
+  fprintf(stderr, "  -P          count CPU cycles, instructions, cache misses and branch mispredicts of each\n");
+  fprintf(stderr, "              stage, reported on exit per MB and per line, and in the metrics\n");
+  fprintf(stderr, "  -s          strip ANSI escape sequences and escape other control characters\n");
   fprintf(stderr, "  -t          add epoch timestamp at the start of each line\n");
+  fprintf(stderr, "  -T TAG      source name for %%T and the \"src\" JSON field (default is the input filename)\n");
+  fprintf(stderr, "  -u MODE     repair invalid UTF-8, MODE is 'replace' (with U+FFFD) or 'escape' (as \\xHH)\n");
+  fprintf(stderr, "  -x FORMAT   extract fields into FILENAME%s sidecars, FORMAT is 'logfmt' or 'json'\n", FIELDS_SUFFIX);
+  fprintf(stderr, "  -y          sync the log file to disk after each input read, before reading more\n");
+}
+
+#ifdef LUMBERJACK_FAULTS
+/* I/O fault injection, for testing the writer and rotation against a slow or failing disk.
+ * Faults are configured by the LUMBERJACK_FAULTS environment variable, a comma separated
+ * list of:
+ *   delay=USEC     delay every write to a log file
+ *   stall=P:USEC   delay a write with probability P
+ *   short=P        write part of the data, then fail with ENOSPC, as a disk filling up does
+ *   enospc=P       fail a write with ENOSPC
+ *   eio=P          fail a write with EIO
+ *   rename=P       fail renaming a log file while rotating with EIO
+ *   open=P         fail opening a new log file with ENOSPC
+ *   seed=N         seed of the random choices (default is 1)
+ * Log files are opened as fopencookie() streams over their descriptors, so faults reach stdio
+ * where the disk's would. */
+struct fault_config {
+  int enabled;
+  long long delay_usec;
+  double stall_p;
+  long long stall_usec;
+  double short_p;
+  double enospc_p;
+  double eio_p;
+  double rename_p;
+  double open_p;
+  unsigned long long state;
+  pthread_mutex_t lock;   /* the field thread rotates sidecars too */
+
+  unsigned long long stalls;
+  unsigned long long short_writes;
+  unsigned long long enospc;
+  unsigned long long eio;
+  unsigned long long renames;
+  unsigned long long opens;
+};
+
+struct fault_config faults = {0, 0, 0, 0, 0, 0, 0, 0, 0, 1, PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, 0, 0};
+
+/* A log file stream, kept in a list so its descriptor can be found */
+struct fault_stream {
+  int fd;
+  FILE* file;
+  struct fault_stream* next;
+};
+
+struct fault_stream* fault_streams = NULL;
+
+/* Parse LUMBERJACK_FAULTS.  Returns 0 on success, including when it is not set. */
+int fault_init(void) {
+  const char* spec = getenv("LUMBERJACK_FAULTS");
+  const char* p = spec;
+
+  if (!spec || !*spec) {
+    return 0;
+  }
+  while (*p) {
+    const char* value = strchr(p, '=');
+    size_t key_len = value ? (size_t)(value - p) : 0;
+    char* end = NULL;
+
+    if (!value) {
+      return 1;
+    }
+    value++;
+    if (key_len == 5 && strncmp(p, "delay", 5) == 0) {
+      faults.delay_usec = strtoll(value, &end, 10);
+    } else if (key_len == 5 && strncmp(p, "stall", 5) == 0) {
+      faults.stall_p = strtod(value, &end);
+      if (*end != ':') {
+        return 1;
+      }
+      faults.stall_usec = strtoll(end + 1, &end, 10);
+    } else if (key_len == 5 && strncmp(p, "short", 5) == 0) {
+      faults.short_p = strtod(value, &end);
+    } else if (key_len == 6 && strncmp(p, "enospc", 6) == 0) {
+      faults.enospc_p = strtod(value, &end);
+    } else if (key_len == 3 && strncmp(p, "eio", 3) == 0) {
+      faults.eio_p = strtod(value, &end);
+    } else if (key_len == 6 && strncmp(p, "rename", 6) == 0) {
+      faults.rename_p = strtod(value, &end);
+    } else if (key_len == 4 && strncmp(p, "open", 4) == 0) {
+      faults.open_p = strtod(value, &end);
+    } else if (key_len == 4 && strncmp(p, "seed", 4) == 0) {
+      faults.state = strtoull(value, &end, 10) * 0x9E3779B97F4A7C15ULL + 1;
+    } else {
+      return 1;
+    }
+    if (end == value || (*end && *end != ',')) {
+      return 1;
+    }
+    p = *end ? end + 1 : end;
+  }
+  faults.enabled = 1;
+  return 0;
+}
+
+/* Return 1 with probability p, counting it in *count */
+int fault_chance(double p, unsigned long long* count) {
+  int hit = 0;
+
+  if (p <= 0) {
+    return 0;
+  }
+  pthread_mutex_lock(&faults.lock);
+  faults.state ^= faults.state >> 12;
+  faults.state ^= faults.state << 25;
+  faults.state ^= faults.state >> 27;
+  hit = ((faults.state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0) < p;
+  *count += hit;
+  pthread_mutex_unlock(&faults.lock);
+  return hit;
+}
+
+void fault_sleep(long long usec) {
+  struct timespec ts = {usec / 1000000, (usec % 1000000) * 1000};
+  while (usec > 0 && nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+  }
+}
+
+ssize_t fault_read(void* cookie, char* buf, size_t len) {
+  return read(((struct fault_stream*)cookie)->fd, buf, len);
+}
+
+/* Returns the bytes written, short on a failure with errno set, as stdio expects */
+ssize_t fault_write(void* cookie, const char* buf, size_t len) {
+  struct fault_stream* s = cookie;
+  size_t written = 0;
+  int torn = 0;
+
+  fault_sleep(faults.delay_usec);
+  if (fault_chance(faults.stall_p, &faults.stalls)) {
+    fault_sleep(faults.stall_usec);
+  }
+  if (fault_chance(faults.enospc_p, &faults.enospc)) {
+    errno = ENOSPC;
+    return 0;
+  }
+  if (fault_chance(faults.eio_p, &faults.eio)) {
+    errno = EIO;
+    return 0;
+  }
+  if (fault_chance(faults.short_p, &faults.short_writes)) {
+    torn = 1;
+    len /= 2;
+  }
+  while (written < len) {
+    ssize_t n = write(s->fd, buf + written, len - written);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    written += n;
+  }
+  if (torn && written == len) {
+    errno = ENOSPC;
+  }
+  return written;
+}
+
+int fault_seek(void* cookie, off64_t* offset, int whence) {
+  off_t pos = lseek(((struct fault_stream*)cookie)->fd, *offset, whence);
+  if (pos < 0) {
+    return -1;
+  }
+  *offset = pos;
+  return 0;
+}
+
+int fault_close(void* cookie) {
+  struct fault_stream* s = cookie;
+  struct fault_stream** p = NULL;
+  int ret = close(s->fd);
+
+  pthread_mutex_lock(&faults.lock);
+  for (p = &fault_streams; *p; p = &(*p)->next) {
+    if (*p == s) {
+      *p = s->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&faults.lock);
+  free(s);
+  return ret;
+}
+
+/* Open filename for appending ("a") or appending and reading ("a+") through the faults */
+FILE* fault_fopen(const char* filename, const char* mode) {
+  cookie_io_functions_t io = {fault_read, fault_write, fault_seek, fault_close};
+  struct fault_stream* s = NULL;
+
+  if (fault_chance(faults.open_p, &faults.opens)) {
+    errno = ENOSPC;
+    return NULL;
+  }
+  s = calloc(1, sizeof(*s));
+  if (!s) {
+    return NULL;
+  }
+  s->fd = open(filename, (mode[1] == '+' ? O_RDWR : O_WRONLY) | O_CREAT | O_APPEND, 0666);
+  if (s->fd < 0) {
+    free(s);
+    return NULL;
+  }
+  s->file = fopencookie(s, mode, io);
+  if (!s->file) {
+    close(s->fd);
+    free(s);
+    return NULL;
+  }
+  pthread_mutex_lock(&faults.lock);
+  s->next = fault_streams;
+  fault_streams = s;
+  pthread_mutex_unlock(&faults.lock);
+  return s->file;
+}
+
+void fault_report(FILE* out) {
+  fprintf(out, "Injected faults: %llu stalls, %llu short writes, %llu ENOSPC, %llu EIO, %llu renames, %llu opens\n",
+          faults.stalls, faults.short_writes, faults.enospc, faults.eio, faults.renames, faults.opens);
 }
+#endif
 
-int rotate_log(FILE** file, const char* filename, int max_files) {
+/* Open a log file for appending, through the injected faults if there are any */
+FILE* log_fopen(const char* filename, const char* mode) {
+#ifdef LUMBERJACK_FAULTS
+  if (faults.enabled) {
+    return fault_fopen(filename, mode);
+  }
+#endif
+  return fopen(filename, mode);
+}
+
+int log_rename(const char* src, const char* dst) {
+#ifdef LUMBERJACK_FAULTS
+  if (faults.enabled && fault_chance(faults.rename_p, &faults.renames)) {
+    errno = EIO;
+    return -1;
+  }
+#endif
+  return rename(src, dst);
+}
+
+/* The descriptor of a log file opened with log_fopen() */
+int log_fileno(FILE* file) {
+#ifdef LUMBERJACK_FAULTS
+  struct fault_stream* s = NULL;
+
+  pthread_mutex_lock(&faults.lock);
+  for (s = fault_streams; s && s->file != file; s = s->next) {
+  }
+  pthread_mutex_unlock(&faults.lock);
+  if (s) {
+    return s->fd;
+  }
+#endif
+  return fileno(file);
+}
+
+/* Rotate the log files filename, filename.1, ... filename.N, where suffix (usually "") is
+ * appended to every name, and open a new filename for writing. */
+int rotate_log(FILE** file, const char* filename, const char* suffix, int max_files) {
   int i = 0;
   struct stat sb = {0};
   char src_file[MAX_FILENAME_LENGTH];
@@ -70,45 +452,4529 @@ int rotate_log(FILE** file, const char* filename, int max_files) {
     *file = NULL;
   }
 
-  /* Remove maximum log filename if it exists */
-  sprintf(src_file, "%s.%d", filename, max_files-1);
-  if (stat(src_file, &sb) == 0) {
-    if (unlink(src_file) != 0) {
-      int err = errno;
-      eprint(err, "Failed to remove old log file: %s", src_file);
-      return 1;
+  /* Remove maximum log filename if it exists */
+  sprintf(src_file, "%s.%d%s", filename, max_files-1, suffix);
+  if (stat(src_file, &sb) == 0) {
+    if (unlink(src_file) != 0) {
+      int err = errno;
+      eprint(err, "Failed to remove old log file: %s", src_file);
+      return 1;
+    }
+  }
+
+  /* Rotate log files */
+  for (i = max_files-1; i > 0; i--) {
+    sprintf(dst_file, "%s.%d%s", filename, i, suffix);
+    if (i == 1) {
+      sprintf(src_file, "%s%s", filename, suffix);
+    } else {
+      sprintf(src_file, "%s.%d%s", filename, i-1, suffix);
+    }
+
+    if (stat(src_file, &sb) == 0) {
+      if (log_rename(src_file, dst_file) != 0) {
+        int err = errno;
+        eprint(err, "Failed to rename log file: %s -> %s", src_file, dst_file);
+        return 1;
+      }
+    }
+  }
+
+  /* Open new log file */
+  sprintf(src_file, "%s%s", filename, suffix);
+  *file = log_fopen(src_file, "a");
+  if (!*file) {
+      int err = errno;
+      eprint(err, "Failed to open new log file for writing: %s", src_file);
+      return 1;
+  }
+
+  return 0;
+}
+
+/* Escape sequence parser states for sanitizing, carried across input blocks */
+enum sanitize_state {
+  SANITIZE_TEXT = 0,   /* plain text */
+  SANITIZE_ESC,        /* ESC seen */
+  SANITIZE_CSI,        /* ESC [ seen, waiting for the final byte */
+  SANITIZE_ESC_INTER,  /* ESC followed by intermediate bytes, waiting for the final byte */
+  SANITIZE_STRING,     /* OSC/DCS/SOS/PM/APC string, waiting for BEL or ST */
+  SANITIZE_STRING_ESC  /* ESC seen inside a string, possibly the start of ST */
+};
+
+int is_control(unsigned char c) {
+  return (c < 0x20 && c != '\t' && c != '\n') || c == 0x7f;
+}
+
+/* Return the offset of the first control character (see is_control()) in buf, or len if the
+ * buffer is clean.  Clean input is the common case, so this is the only per-byte work done
+ * for it.  Called through find_control, which points at the best variant for the CPU. */
+size_t find_control_base(const char* buf, size_t len) {
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i max_ctl = _mm_set1_epi8(0x1f);
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i nl = _mm_set1_epi8('\n');
+  const __m128i del = _mm_set1_epi8(0x7f);
+#define CONTROL_MASK(v) _mm_or_si128(_mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, nl)), \
+                                                      _mm_cmpeq_epi8(_mm_min_epu8(v, max_ctl), v)), \
+                                     _mm_cmpeq_epi8(v, del))
+
+  /* Check 64 bytes at a time, only locating the exact byte once something is found */
+  for (; i + 64 <= len; i += 64) {
+    __m128i m0 = CONTROL_MASK(_mm_loadu_si128((const __m128i*)(buf + i)));
+    __m128i m1 = CONTROL_MASK(_mm_loadu_si128((const __m128i*)(buf + i + 16)));
+    __m128i m2 = CONTROL_MASK(_mm_loadu_si128((const __m128i*)(buf + i + 32)));
+    __m128i m3 = CONTROL_MASK(_mm_loadu_si128((const __m128i*)(buf + i + 48)));
+    if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(m0, m1), _mm_or_si128(m2, m3)))) {
+      break;
+    }
+  }
+  for (; i + 16 <= len; i += 16) {
+    int mask = _mm_movemask_epi8(CONTROL_MASK(_mm_loadu_si128((const __m128i*)(buf + i))));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#undef CONTROL_MASK
+#endif
+
+  for (; i < len; i++) {
+    if (is_control(buf[i])) {
+      return i;
+    }
+  }
+  return len;
+}
+
+size_t (*find_control)(const char* buf, size_t len) = find_control_base;
+
+/* Copy len bytes of in to out, dropping ANSI escape sequences and replacing other control
+ * characters with "\xHH".  out must have room for MAX_SANITIZE_EXPANSION * len bytes.
+ * Returns the number of bytes written to out. */
+size_t sanitize_block(enum sanitize_state* state, const char* in, size_t len, char* out) {
+  static const char hex[] = "0123456789abcdef";
+  char* o = out;
+  size_t i = 0;
+
+  while (i < len) {
+    unsigned char c = in[i];
+
+    switch (*state) {
+      case SANITIZE_TEXT: {
+        size_t clean = find_control(in + i, len - i);
+        memcpy(o, in + i, clean);
+        o += clean;
+        i += clean;
+        if (i == len) {
+          break;
+        }
+        c = in[i++];
+        if (c == 0x1b) {
+          *state = SANITIZE_ESC;
+        } else {
+          *o++ = '\\';
+          *o++ = 'x';
+          *o++ = hex[c >> 4];
+          *o++ = hex[c & 0xf];
+        }
+        break;
+      }
+
+      case SANITIZE_ESC:
+        i++;
+        if (c == '[') {
+          *state = SANITIZE_CSI;
+        } else if (c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_') {
+          *state = SANITIZE_STRING;
+        } else if (c >= 0x20 && c <= 0x2f) {
+          *state = SANITIZE_ESC_INTER;
+        } else if (c >= 0x30 && c <= 0x7e) {
+          *state = SANITIZE_TEXT;
+        } else {
+          /* Not an escape sequence; keep the byte and let the text state handle it */
+          *state = SANITIZE_TEXT;
+          i--;
+        }
+        break;
+
+      case SANITIZE_CSI:
+      case SANITIZE_ESC_INTER:
+        i++;
+        if (c >= 0x20 && c <= 0x3f && (*state == SANITIZE_CSI || c <= 0x2f)) {
+          /* Parameter or intermediate byte */
+        } else if (c >= 0x30 && c <= 0x7e) {
+          *state = SANITIZE_TEXT;
+        } else {
+          /* Malformed sequence; drop what was seen and reprocess this byte as text */
+          *state = SANITIZE_TEXT;
+          i--;
+        }
+        break;
+
+      case SANITIZE_STRING:
+      case SANITIZE_STRING_ESC:
+        i++;
+        if (c == 0x07 || (*state == SANITIZE_STRING_ESC && c == '\\')) {
+          *state = SANITIZE_TEXT;
+        } else if (c == '\n') {
+          /* Never let an unterminated string swallow following lines */
+          *state = SANITIZE_TEXT;
+          *o++ = '\n';
+        } else {
+          *state = (c == 0x1b) ? SANITIZE_STRING_ESC : SANITIZE_STRING;
+        }
+        break;
+    }
+  }
+
+  return o - out;
+}
+
+/* UTF-8 repair modes */
+enum utf8_mode {
+  UTF8_OFF = 0,
+  UTF8_REPLACE,  /* replace each maximal invalid subpart with U+FFFD */
+  UTF8_ESCAPE    /* write each invalid byte as "\xHH" */
+};
+
+/* UTF-8 repair state, carried across input blocks */
+struct utf8_state {
+  enum utf8_mode mode;
+  unsigned char pending[MAX_UTF8_PENDING];  /* incomplete sequence at the end of the last block */
+  size_t pending_len;
+};
+
+/* Results of checking a single UTF-8 sequence */
+enum utf8_result {
+  UTF8_VALID = 0,
+  UTF8_INVALID,
+  UTF8_INCOMPLETE
+};
+
+/* Check the multi-byte sequence at the start of s, following RFC 3629 (no overlong forms,
+ * surrogates or code points above U+10FFFF).  On UTF8_VALID, *consumed is the sequence
+ * length; on UTF8_INVALID it is the length of the maximal subpart to replace (at least 1);
+ * on UTF8_INCOMPLETE all avail bytes are a valid prefix of a sequence. */
+enum utf8_result utf8_check_sequence(const unsigned char* s, size_t avail, size_t* consumed) {
+  unsigned char lo = 0x80, hi = 0xbf;
+  size_t need = 0, i = 0;
+
+  if (s[0] < 0x80) {
+    need = 1;
+  } else if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+    need = 2;
+  } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+    need = 3;
+    lo = (s[0] == 0xe0) ? 0xa0 : 0x80;
+    hi = (s[0] == 0xed) ? 0x9f : 0xbf;
+  } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+    need = 4;
+    lo = (s[0] == 0xf0) ? 0x90 : 0x80;
+    hi = (s[0] == 0xf4) ? 0x8f : 0xbf;
+  } else {
+    *consumed = 1;
+    return UTF8_INVALID;
+  }
+
+  /* Only the first continuation byte has a restricted range */
+  for (i = 1; i < need; i++) {
+    if (i >= avail) {
+      *consumed = i;
+      return UTF8_INCOMPLETE;
+    }
+    if (s[i] < lo || s[i] > hi) {
+      *consumed = i;
+      return UTF8_INVALID;
+    }
+    lo = 0x80;
+    hi = 0xbf;
+  }
+  *consumed = need;
+  return UTF8_VALID;
+}
+
+/* Return the offset of the first non-ASCII byte in buf, or len if there is none.  Called
+ * through find_non_ascii, which points at the best variant for the CPU. */
+size_t find_non_ascii_base(const char* buf, size_t len) {
+  const unsigned char* s = (const unsigned char*)buf;
+  size_t i = 0;
+
+#ifdef __SSE2__
+  for (; i + 64 <= len; i += 64) {
+    __m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i*)(s + i)),
+                                          _mm_loadu_si128((const __m128i*)(s + i + 16))),
+                             _mm_or_si128(_mm_loadu_si128((const __m128i*)(s + i + 32)),
+                                          _mm_loadu_si128((const __m128i*)(s + i + 48))));
+    if (_mm_movemask_epi8(v)) {
+      break;
+    }
+  }
+  for (; i + 16 <= len; i += 16) {
+    int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(s + i)));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; i < len && s[i] < 0x80; i++);
+  return i;
+}
+
+size_t (*find_non_ascii)(const char* buf, size_t len) = find_non_ascii_base;
+
+/* Return the length of the longest prefix of buf that is complete, valid UTF-8.  Runs of
+ * ASCII are skipped 64 bytes at a time, so typical log text is validated at close to memory
+ * bandwidth and only multi-byte sequences are decoded. */
+size_t utf8_valid_prefix(const char* buf, size_t len) {
+  const unsigned char* s = (const unsigned char*)buf;
+  size_t i = 0, n = 0;
+
+  while (i < len) {
+    i += find_non_ascii(buf + i, len - i);
+    if (i == len) {
+      break;
+    }
+
+    /* Decode multi-byte sequences until the next ASCII byte */
+    while (i < len && s[i] >= 0x80) {
+      if (utf8_check_sequence(s + i, len - i, &n) != UTF8_VALID) {
+        return i;
+      }
+      i += n;
+    }
+  }
+  return len;
+}
+
+/* Write the invalid bytes s[0..n) to out as configured, returning the bytes written */
+size_t utf8_write_invalid(enum utf8_mode mode, const unsigned char* s, size_t n, char* out) {
+  static const char hex[] = "0123456789abcdef";
+  size_t i = 0;
+
+  if (mode == UTF8_REPLACE) {
+    memcpy(out, "\xef\xbf\xbd", 3);
+    return 3;
+  }
+  for (i = 0; i < n; i++) {
+    out[4*i] = '\\';
+    out[4*i + 1] = 'x';
+    out[4*i + 2] = hex[s[i] >> 4];
+    out[4*i + 3] = hex[s[i] & 0xf];
+  }
+  return 4*n;
+}
+
+/* Copy len bytes of in to out, repairing invalid UTF-8.  A sequence left incomplete at the
+ * end of in is held in the state and completed from the next block, or repaired when the
+ * input ends (len == 0).  out must have room for MAX_UTF8_EXPANSION * (len + MAX_UTF8_PENDING)
+ * bytes.  Returns the number of bytes written to out. */
+size_t utf8_repair_block(struct utf8_state* state, const char* in, size_t len, char* out) {
+  const unsigned char* s = (const unsigned char*)in;
+  char* o = out;
+  size_t i = 0, n = 0;
+
+  /* Finish a sequence started in the previous block */
+  if (state->pending_len) {
+    unsigned char seq[4];
+    size_t take = (len < 4 - state->pending_len) ? len : 4 - state->pending_len;
+    enum utf8_result r = UTF8_INCOMPLETE;
+
+    memcpy(seq, state->pending, state->pending_len);
+    memcpy(seq + state->pending_len, s, take);
+    r = utf8_check_sequence(seq, state->pending_len + take, &n);
+    if (r == UTF8_INCOMPLETE && len != 0) {
+      memcpy(state->pending, seq, n);
+      state->pending_len = n;
+      return 0;
+    }
+    if (r == UTF8_VALID) {
+      memcpy(o, seq, n);
+      o += n;
+    } else {
+      o += utf8_write_invalid(state->mode, seq, n, o);
+    }
+    i = n - state->pending_len;
+    state->pending_len = 0;
+  }
+
+  while (i < len) {
+    n = utf8_valid_prefix(in + i, len - i);
+    memcpy(o, in + i, n);
+    o += n;
+    i += n;
+    if (i == len) {
+      break;
+    }
+
+    if (utf8_check_sequence(s + i, len - i, &n) == UTF8_INCOMPLETE) {
+      memcpy(state->pending, s + i, n);
+      state->pending_len = n;
+      break;
+    }
+    o += utf8_write_invalid(state->mode, s + i, n, o);
+    i += n;
+  }
+
+  return o - out;
+}
+
+/* Return the offset of the first byte in buf that must be escaped inside a JSON string, or
+ * len if none do.  Most log lines need no escaping, so this check is the common case.  Called
+ * through find_json_escape, which points at the best variant for the CPU. */
+size_t find_json_escape_base(const char* buf, size_t len) {
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i max_ctl = _mm_set1_epi8(0x1f);
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+#define JSON_ESCAPE_MASK(v) _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, max_ctl), v), \
+                                         _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)))
+
+  for (; i + 64 <= len; i += 64) {
+    __m128i m0 = JSON_ESCAPE_MASK(_mm_loadu_si128((const __m128i*)(buf + i)));
+    __m128i m1 = JSON_ESCAPE_MASK(_mm_loadu_si128((const __m128i*)(buf + i + 16)));
+    __m128i m2 = JSON_ESCAPE_MASK(_mm_loadu_si128((const __m128i*)(buf + i + 32)));
+    __m128i m3 = JSON_ESCAPE_MASK(_mm_loadu_si128((const __m128i*)(buf + i + 48)));
+    if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(m0, m1), _mm_or_si128(m2, m3)))) {
+      break;
+    }
+  }
+  for (; i + 16 <= len; i += 16) {
+    int mask = _mm_movemask_epi8(JSON_ESCAPE_MASK(_mm_loadu_si128((const __m128i*)(buf + i))));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#undef JSON_ESCAPE_MASK
+#endif
+
+  for (; i < len; i++) {
+    unsigned char c = buf[i];
+    if (c < 0x20 || c == '"' || c == '\\') {
+      return i;
+    }
+  }
+  return len;
+}
+
+size_t (*find_json_escape)(const char* buf, size_t len) = find_json_escape_base;
+
+/* Copy len bytes of in to out escaped as the contents of a JSON string.  out must have room
+ * for MAX_JSON_EXPANSION * len bytes.  Returns the number of bytes written to out. */
+size_t json_escape(const char* in, size_t len, char* out) {
+  static const char hex[] = "0123456789abcdef";
+  char* o = out;
+  size_t i = 0;
+
+  while (i < len) {
+    size_t clean = find_json_escape(in + i, len - i);
+    unsigned char c = 0;
+
+    memcpy(o, in + i, clean);
+    o += clean;
+    i += clean;
+    if (i == len) {
+      break;
+    }
+
+    c = in[i++];
+    *o++ = '\\';
+    switch (c) {
+      case '"':  *o++ = '"'; break;
+      case '\\': *o++ = '\\'; break;
+      case '\b': *o++ = 'b'; break;
+      case '\f': *o++ = 'f'; break;
+      case '\n': *o++ = 'n'; break;
+      case '\r': *o++ = 'r'; break;
+      case '\t': *o++ = 't'; break;
+      default:
+        *o++ = 'u';
+        *o++ = '0';
+        *o++ = '0';
+        *o++ = hex[c >> 4];
+        *o++ = hex[c & 0xf];
+        break;
+    }
+  }
+
+  return o - out;
+}
+
+/* Write len bytes of in to file as the contents of a JSON string, escaping through buf
+ * (MAX_JSON_EXPANSION * JSON_ESCAPE_CHUNK bytes) when needed.  Returns 0 on success. */
+int fwrite_json_string(const char* in, size_t len, char* buf, FILE* file) {
+  while (len > 0) {
+    size_t chunk = (len < JSON_ESCAPE_CHUNK) ? len : JSON_ESCAPE_CHUNK;
+
+    if (find_json_escape(in, chunk) == chunk) {
+      if (fwrite(in, 1, chunk, file) != chunk) {
+        return 1;
+      }
+    } else {
+      size_t out_len = json_escape(in, chunk, buf);
+      if (fwrite(buf, 1, out_len, file) != out_len) {
+        return 1;
+      }
+    }
+    in += chunk;
+    len -= chunk;
+  }
+  return 0;
+}
+
+/* Append an unsigned LEB128 varint to buf, returning the number of bytes written (at most 10) */
+size_t put_varint(unsigned char* buf, unsigned long long v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    buf[n++] = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  buf[n++] = (unsigned char)v;
+  return n;
+}
+
+/* Read a varint from buf[*pos..len) into *v, advancing *pos.  Returns 0 on success. */
+int get_varint(const unsigned char* buf, size_t len, size_t* pos, unsigned long long* v) {
+  unsigned long long r = 0;
+  int shift = 0;
+  while (*pos < len && shift < 64) {
+    unsigned char b = buf[(*pos)++];
+    r |= (unsigned long long)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      *v = r;
+      return 0;
+    }
+    shift += 7;
+  }
+  return 1;
+}
+
+unsigned long long zigzag_encode(long long v) {
+  return ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63);
+}
+
+long long zigzag_decode(unsigned long long v) {
+  return (long long)(v >> 1) ^ -(long long)(v & 1);
+}
+
+/* Growable byte buffer */
+struct byte_buffer {
+  unsigned char* data;
+  size_t len;
+  size_t size;
+};
+
+/* Ensure room for n more bytes in buf.  Returns 0 on success. */
+int buffer_reserve(struct byte_buffer* buf, size_t n) {
+  if (buf->len + n > buf->size) {
+    size_t size = buf->size ? buf->size : 4096;
+    unsigned char* data = NULL;
+    while (size < buf->len + n) {
+      size *= 2;
+    }
+    data = realloc(buf->data, size);
+    if (!data) {
+      return 1;
+    }
+    buf->data = data;
+    buf->size = size;
+  }
+  return 0;
+}
+
+int buffer_append(struct byte_buffer* buf, const void* data, size_t n) {
+  if (n == 0) {
+    return 0;  /* an empty buffer may have no data yet, and memcpy must not be given NULL */
+  }
+  if (buffer_reserve(buf, n) != 0) {
+    return 1;
+  }
+  memcpy(buf->data + buf->len, data, n);
+  buf->len += n;
+  return 0;
+}
+
+int buffer_append_varint(struct byte_buffer* buf, unsigned long long v) {
+  if (buffer_reserve(buf, 10) != 0) {
+    return 1;
+  }
+  buf->len += put_varint(buf->data + buf->len, v);
+  return 0;
+}
+
+/* 64-bit FNV-1a hash */
+unsigned long long hash_bytes(const char* data, size_t len) {
+  unsigned long long h = 0xcbf29ce484222325ULL;
+  size_t i = 0;
+  for (i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/* Parse s as a canonical decimal integer (no sign other than '-', no leading zeros, at most
+ * 18 digits), so that rendering the value reproduces s exactly.  Returns 0 on success. */
+int parse_canonical_int(const char* s, size_t len, long long* v) {
+  size_t i = 0;
+  long long r = 0;
+  int neg = 0;
+
+  if (len > 0 && s[0] == '-') {
+    neg = 1;
+    i = 1;
+  }
+  if (i == len || len - i > 18 || (s[i] == '0' && (len - i > 1 || neg))) {
+    return 1;
+  }
+  for (; i < len; i++) {
+    if (s[i] < '0' || s[i] > '9') {
+      return 1;
+    }
+    r = r*10 + (s[i] - '0');
+  }
+  *v = neg ? -r : r;
+  return 0;
+}
+
+long long monotonic_ns(void) {
+  struct timespec ts = {0};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Threads recording trace spans (-D), each into its own buffer so no locking is needed */
+enum trace_thread {
+  TRACE_MAIN = 0,
+  TRACE_FIELDS,
+  TRACE_ARCHIVE,
+  TRACE_THREADS
+};
+
+struct trace_span {
+  const char* name;
+  long long start_ns;
+  long long end_ns;
+};
+
+/* Ring of the most recent spans of a thread, only read once the thread has stopped */
+struct trace_buffer {
+  struct trace_span* spans;
+  unsigned long long count;
+};
+
+/* Set before any thread starts, and never changed while they run */
+int tracing = 0;
+struct trace_buffer trace_buffers[TRACE_THREADS];
+
+/* Start time of a span, only read from the clock if tracing */
+long long trace_now(void) {
+  return tracing ? monotonic_ns() : 0;
+}
+
+/* Record a span of thread from start_ns until now */
+void trace_span(enum trace_thread thread, const char* name, long long start_ns) {
+  struct trace_buffer* b = &trace_buffers[thread];
+  struct trace_span* span = NULL;
+
+  if (!tracing) {
+    return;
+  }
+  span = &b->spans[b->count++ % TRACE_MAX_SPANS];
+  span->name = name;
+  span->start_ns = start_ns;
+  span->end_ns = monotonic_ns();
+}
+
+/* Allocate the span buffers of all threads.  Returns 0 on success. */
+int trace_start(void) {
+  int i = 0;
+
+  for (i = 0; i < TRACE_THREADS; i++) {
+    trace_buffers[i].spans = malloc(TRACE_MAX_SPANS * sizeof(struct trace_span));
+    if (!trace_buffers[i].spans) {
+      return 1;
+    }
+  }
+  tracing = 1;
+  return 0;
+}
+
+/* Write the recorded spans of all threads as Chrome trace-event JSON, for chrome://tracing or
+ * Perfetto.  Returns 0 on success. */
+int trace_write(const char* filename) {
+  static const char* thread_names[TRACE_THREADS] = {"main", "fields", "archive"};
+  FILE* file = fopen(filename, "w");
+  int i = 0;
+
+  if (!file) {
+    return 1;
+  }
+  fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  for (i = 0; i < TRACE_THREADS; i++) {
+    const struct trace_buffer* b = &trace_buffers[i];
+    unsigned long long n = b->count < TRACE_MAX_SPANS ? 0 : b->count - TRACE_MAX_SPANS;
+
+    fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            i ? ",\n" : "", (int)getpid(), i + 1, thread_names[i]);
+    for (; n < b->count; n++) {
+      const struct trace_span* span = &b->spans[n % TRACE_MAX_SPANS];
+      fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%lld.%03lld,\"dur\":%lld.%03lld}",
+              span->name, (int)getpid(), i + 1, span->start_ns / 1000, span->start_ns % 1000,
+              (span->end_ns - span->start_ns) / 1000, (span->end_ns - span->start_ns) % 1000);
+    }
+  }
+  fprintf(file, "\n]}\n");
+  i = ferror(file);
+  return (fclose(file) != 0 || i) ? 1 : 0;
+}
+
+/* Free the span buffers */
+void trace_stop(void) {
+  int i = 0;
+
+  tracing = 0;
+  for (i = 0; i < TRACE_THREADS; i++) {
+    free(trace_buffers[i].spans);
+    trace_buffers[i].spans = NULL;
+  }
+}
+
+/* Formats of lines to extract fields from */
+enum field_format {
+  FIELDS_OFF = 0,
+  FIELDS_LOGFMT,  /* key=value key2="quoted value" ... */
+  FIELDS_JSON     /* {"key":value,...}, top level keys only */
+};
+
+/* Column types in the sidecar file */
+enum field_type {
+  FIELD_STRING = 0,  /* dictionary encoded */
+  FIELD_INT          /* delta encoded */
+};
+
+/* A batch of input lines handed from the writer to the field extraction thread */
+struct field_batch {
+  struct field_batch* next;
+  int rotations;        /* log rotations before these lines */
+  long first_line;      /* line number of the first line within its log file, from 1 as %n */
+  size_t lines;         /* number of complete lines */
+  size_t complete_len;  /* length of the complete lines */
+  size_t len;           /* length including a partial line at the end */
+  int truncating;       /* partial line is longer than the batch, skip the rest of it */
+  char data[FIELD_BATCH_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+/* Values of one key for the rows of the current block */
+struct field_column {
+  char name[MAX_FIELD_NAME_LENGTH];
+  size_t name_len;
+  size_t offsets[FIELD_BLOCK_ROWS];  /* into the block arena */
+  int lengths[FIELD_BLOCK_ROWS];     /* -1 if absent */
+};
+
+/* Field extraction state, shared between the writer and the extraction thread */
+struct field_extractor {
+  enum field_format format;
+  const char* filename;
+  int max_files;
+  int huge_pages;                /* back the batch pool with huge pages */
+
+  /* Batches, allocated once; those not in use are on the free list */
+  struct field_batch* pool;
+  size_t pool_mapped;            /* size if mapped rather than allocated */
+
+  /* Writer side */
+  struct field_batch* batch;     /* batch being filled */
+  int pending_rotations;         /* rotations not yet handed off */
+  long line_number;              /* line number of the next line within the log file */
+  unsigned long long dropped;    /* lines not extracted because the queue was full */
+
+  /* Queue, protected by lock */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct field_batch* head;
+  struct field_batch* tail;
+  int queue_length;
+  struct field_batch* free;
+  int done;
+
+  /* Extraction thread side */
+  pthread_t thread;
+  FILE* file;
+  long block_first_line;
+  size_t block_rows;
+  struct field_column* columns;
+  int column_count;
+  char* arena;
+  size_t arena_len;
+  unsigned int* slots;           /* dictionary hash table, for encoding blocks */
+  unsigned int* indexes;         /* dictionary entry of each row */
+  struct byte_buffer out;
+};
+
+/* Record value for key in the current row of the block */
+void field_add(struct field_extractor* ex, const char* key, size_t key_len, const char* value, size_t value_len) {
+  struct field_column* col = NULL;
+  int i = 0;
+
+  if (key_len == 0 || key_len > MAX_FIELD_NAME_LENGTH || ex->arena_len + value_len > FIELD_ARENA_SIZE) {
+    return;
+  }
+  for (i = 0; i < ex->column_count; i++) {
+    if (ex->columns[i].name_len == key_len && memcmp(ex->columns[i].name, key, key_len) == 0) {
+      col = &ex->columns[i];
+      break;
+    }
+  }
+  if (!col) {
+    if (ex->column_count == MAX_FIELD_COLUMNS) {
+      return;
+    }
+    col = &ex->columns[ex->column_count++];
+    memcpy(col->name, key, key_len);
+    col->name_len = key_len;
+    for (i = 0; i < FIELD_BLOCK_ROWS; i++) {
+      col->lengths[i] = -1;
+    }
+  }
+
+  memcpy(ex->arena + ex->arena_len, value, value_len);
+  col->offsets[ex->block_rows] = ex->arena_len;
+  col->lengths[ex->block_rows] = value_len;
+  ex->arena_len += value_len;
+}
+
+/* Extract key=value pairs from a logfmt line */
+void field_parse_logfmt(struct field_extractor* ex, const char* line, size_t len) {
+  size_t i = 0;
+
+  while (i < len) {
+    size_t key = 0, key_len = 0, value = 0, value_len = 0;
+
+    while (i < len && line[i] == ' ') {
+      i++;
+    }
+    key = i;
+    while (i < len && line[i] != ' ' && line[i] != '=' && line[i] != '"') {
+      i++;
+    }
+    key_len = i - key;
+    if (i == len || line[i] != '=') {
+      /* Not a key=value pair, skip the word */
+      while (i < len && line[i] != ' ') {
+        i++;
+      }
+      continue;
+    }
+
+    i++;
+    if (i < len && line[i] == '"') {
+      value = ++i;
+      while (i < len && line[i] != '"') {
+        i += (line[i] == '\\' && i + 1 < len) ? 2 : 1;
+      }
+      value_len = ((i < len) ? i : len) - value;
+      i++;
+    } else {
+      value = i;
+      while (i < len && line[i] != ' ') {
+        i++;
+      }
+      value_len = i - value;
+    }
+    field_add(ex, line + key, key_len, line + value, value_len);
+  }
+}
+
+/* Skip a JSON string starting after its opening quote, returning the offset of the closing quote */
+size_t json_skip_string(const char* line, size_t len, size_t i) {
+  while (i < len && line[i] != '"') {
+    i += (line[i] == '\\') ? 2 : 1;
+  }
+  return (i < len) ? i : len;
+}
+
+/* Extract the top level members of a JSON object line.  String values are kept as written
+ * (still escaped), nested objects and arrays as their JSON text. */
+void field_parse_json(struct field_extractor* ex, const char* line, size_t len) {
+  size_t i = 0;
+
+  while (i < len && (line[i] == ' ' || line[i] == '\t')) {
+    i++;
+  }
+  if (i == len || line[i] != '{') {
+    return;
+  }
+  i++;
+
+  while (i < len) {
+    size_t key = 0, key_len = 0, value = 0, value_len = 0;
+
+    while (i < len && (line[i] == ' ' || line[i] == '\t' || line[i] == ',')) {
+      i++;
+    }
+    if (i == len || line[i] != '"') {
+      return;
+    }
+    key = i + 1;
+    i = json_skip_string(line, len, key);
+    key_len = i - key;
+    i++;
+    while (i < len && (line[i] == ' ' || line[i] == '\t' || line[i] == ':')) {
+      i++;
+    }
+    if (i == len) {
+      return;
+    }
+
+    if (line[i] == '"') {
+      value = i + 1;
+      i = json_skip_string(line, len, value);
+      value_len = i - value;
+      i++;
+    } else if (line[i] == '{' || line[i] == '[') {
+      int depth = 0;
+      value = i;
+      for (; i < len; i++) {
+        if (line[i] == '"') {
+          i = json_skip_string(line, len, i + 1);
+        } else if (line[i] == '{' || line[i] == '[') {
+          depth++;
+        } else if ((line[i] == '}' || line[i] == ']') && --depth == 0) {
+          i++;
+          break;
+        }
+      }
+      value_len = i - value;
+    } else {
+      value = i;
+      while (i < len && line[i] != ',' && line[i] != '}' && line[i] != ' ') {
+        i++;
+      }
+      value_len = i - value;
+    }
+    field_add(ex, line + key, key_len, line + value, value_len);
+  }
+}
+
+/* Encode the current block to the sidecar file and start a new one.  Block layout (all
+ * integers varints):
+ *   "LJCB" first_line rows columns
+ *   per column: name_len name type data_len data
+ * String data is a dictionary (count, then length and bytes of each entry) followed by an
+ * index per row (0 if absent, else entry + 1).  Integer data is a presence bitmap followed by
+ * the zigzag delta from the previous present value for each present row. */
+void field_flush_block(struct field_extractor* ex) {
+  struct byte_buffer* out = &ex->out;
+  unsigned int* slots = ex->slots;
+  unsigned int* indexes = ex->indexes;
+  int i = 0, failed = 0;
+  size_t r = 0;
+
+  if (ex->block_rows == 0 || !ex->file) {
+    goto reset;
+  }
+
+  out->len = 0;
+  failed |= buffer_append(out, "LJCB", 4);
+  failed |= buffer_append_varint(out, ex->block_first_line);
+  failed |= buffer_append_varint(out, ex->block_rows);
+  failed |= buffer_append_varint(out, ex->column_count);
+
+  for (i = 0; i < ex->column_count && !failed; i++) {
+    struct field_column* col = &ex->columns[i];
+    enum field_type type = FIELD_INT;
+    size_t data_start = 0, header_len = 0;
+    unsigned char header[32];
+    long long v = 0, prev = 0;
+
+    for (r = 0; r < ex->block_rows && type == FIELD_INT; r++) {
+      if (col->lengths[r] >= 0 && parse_canonical_int(ex->arena + col->offsets[r], col->lengths[r], &v) != 0) {
+        type = FIELD_STRING;
+      }
+    }
+
+    failed |= buffer_append_varint(out, col->name_len);
+    failed |= buffer_append(out, col->name, col->name_len);
+    data_start = out->len;
+
+    if (type == FIELD_INT) {
+      unsigned char bitmap[FIELD_BLOCK_ROWS / 8] = {0};
+      for (r = 0; r < ex->block_rows; r++) {
+        if (col->lengths[r] >= 0) {
+          bitmap[r / 8] |= 1 << (r % 8);
+        }
+      }
+      failed |= buffer_append(out, bitmap, (ex->block_rows + 7) / 8);
+      for (r = 0; r < ex->block_rows; r++) {
+        if (col->lengths[r] >= 0) {
+          parse_canonical_int(ex->arena + col->offsets[r], col->lengths[r], &v);
+          failed |= buffer_append_varint(out, zigzag_encode(v - prev));
+          prev = v;
+        }
+      }
+    } else {
+      /* Build the dictionary with an open addressing hash table of entry indexes */
+      unsigned int entries = 0, mask = 2 * FIELD_BLOCK_ROWS - 1;
+      size_t count_pos = out->len;
+
+      memset(slots, 0, 2 * FIELD_BLOCK_ROWS * sizeof(*slots));
+      failed |= buffer_reserve(out, 10);
+      out->len += 10;  /* room for the entry count, moved into place below */
+      for (r = 0; r < ex->block_rows; r++) {
+        const char* value = ex->arena + col->offsets[r];
+        unsigned int slot = 0;
+
+        indexes[r] = 0;
+        if (col->lengths[r] < 0) {
+          continue;
+        }
+        slot = hash_bytes(value, col->lengths[r]) & mask;
+        while (slots[slot]) {
+          size_t other = slots[slot] - 1;
+          if (col->lengths[other] == col->lengths[r] && memcmp(ex->arena + col->offsets[other], value, col->lengths[r]) == 0) {
+            break;
+          }
+          slot = (slot + 1) & mask;
+        }
+        if (!slots[slot]) {
+          slots[slot] = r + 1;
+          indexes[r] = ++entries;
+          failed |= buffer_append_varint(out, col->lengths[r]);
+          failed |= buffer_append(out, value, col->lengths[r]);
+        } else {
+          indexes[r] = indexes[slots[slot] - 1];
+        }
+      }
+      if (!failed) {
+        size_t n = put_varint(header, entries);
+        memmove(out->data + count_pos + n, out->data + count_pos + 10, out->len - count_pos - 10);
+        memcpy(out->data + count_pos, header, n);
+        out->len -= 10 - n;
+      }
+      for (r = 0; r < ex->block_rows; r++) {
+        failed |= buffer_append_varint(out, indexes[r]);
+      }
+    }
+    if (failed) {
+      break;
+    }
+
+    /* Insert the type and data length in front of the data */
+    header[0] = type;
+    header_len = 1 + put_varint(header + 1, out->len - data_start);
+    failed |= buffer_reserve(out, header_len);
+    if (!failed) {
+      memmove(out->data + data_start + header_len, out->data + data_start, out->len - data_start);
+      memcpy(out->data + data_start, header, header_len);
+      out->len += header_len;
+    }
+  }
+
+  if (!failed && fwrite(out->data, 1, out->len, ex->file) != out->len) {
+    int err = errno;
+    wprint(err, "Failed to write field sidecar%s", "");
+  }
+  if (!failed && fflush(ex->file) != 0) {
+    int err = errno;
+    wprint(err, "Failed to flush field sidecar%s", "");
+  }
+
+  reset:
+    if (failed) {
+      wprint(0, "Failed to encode field block, %lu lines lost", (unsigned long)ex->block_rows);
+    }
+    ex->block_first_line += ex->block_rows;
+    ex->block_rows = 0;
+    ex->column_count = 0;
+    ex->arena_len = 0;
+}
+
+/* Extract fields from the lines of a batch */
+void field_process_batch(struct field_extractor* ex, struct field_batch* batch) {
+  const char* line = batch->data;
+  const char* end = batch->data + batch->complete_len;
+  int i = 0;
+
+  /* Follow the log rotations, then start the block at this batch unless it continues it */
+  for (i = 0; i < batch->rotations; i++) {
+    field_flush_block(ex);
+    if (rotate_log(&ex->file, ex->filename, FIELDS_SUFFIX, ex->max_files) != 0) {
+      wprint(0, "Failed to rotate field sidecar%s", "");
+    }
+  }
+  if (batch->first_line != ex->block_first_line + (long)ex->block_rows) {
+    field_flush_block(ex);
+  }
+  if (ex->block_rows == 0) {
+    ex->block_first_line = batch->first_line;
+  }
+
+  while (line < end) {
+    const char* nl = memchr(line, '\n', end - line);
+    size_t len = nl - line;
+
+    if (ex->format == FIELDS_LOGFMT) {
+      field_parse_logfmt(ex, line, len);
+    } else {
+      field_parse_json(ex, line, len);
+    }
+    ex->block_rows++;
+    if (ex->block_rows == FIELD_BLOCK_ROWS || ex->arena_len > FIELD_ARENA_SIZE / 2) {
+      field_flush_block(ex);
+    }
+    line = nl + 1;
+  }
+}
+
+void* field_thread(void* arg) {
+  struct field_extractor* ex = arg;
+  struct field_batch* batch = NULL;
+
+  while (1) {
+    long long start_ns = 0;
+
+    pthread_mutex_lock(&ex->lock);
+    if (batch) {
+      /* Return the last batch to the pool */
+      batch->next = ex->free;
+      ex->free = batch;
+    }
+    while (!ex->head && !ex->done) {
+      pthread_cond_wait(&ex->cond, &ex->lock);
+    }
+    batch = ex->head;
+    if (batch) {
+      ex->head = batch->next;
+      if (!ex->head) {
+        ex->tail = NULL;
+      }
+      ex->queue_length--;
+    }
+    pthread_mutex_unlock(&ex->lock);
+
+    if (!batch) {
+      break;
+    }
+    start_ns = trace_now();
+    field_process_batch(ex, batch);
+    trace_span(TRACE_FIELDS, "extract", start_ns);
+  }
+
+  field_flush_block(ex);
+  return NULL;
+}
+
+/* Allocate the pool of batches, cache line aligned, and with -H on huge pages: reserved ones
+ * if the system has them, else transparent ones.  Returns 0 on success. */
+int field_pool_start(struct field_extractor* ex) {
+  size_t size = FIELD_POOL_LENGTH * sizeof(struct field_batch);
+  void* pool = NULL;
+  int i = 0;
+
+  if (ex->huge_pages) {
+    size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+#ifdef MAP_HUGETLB
+    pool = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (pool != MAP_FAILED) {
+      ex->pool_mapped = size;
+    } else {
+      pool = NULL;
+    }
+#endif
+    if (!pool && posix_memalign(&pool, HUGE_PAGE_SIZE, size) == 0) {
+#ifdef MADV_HUGEPAGE
+      madvise(pool, size, MADV_HUGEPAGE);
+#endif
+    }
+  } else if (posix_memalign(&pool, CACHE_LINE_SIZE, size) != 0) {
+    pool = NULL;
+  }
+  if (!pool) {
+    return 1;
+  }
+
+  ex->pool = pool;
+  for (i = FIELD_POOL_LENGTH - 1; i >= 0; i--) {
+    ex->pool[i].next = ex->free;
+    ex->free = &ex->pool[i];
+  }
+  return 0;
+}
+
+/* Start batch for the writer, moving any partial line over from prev (which may be the same
+ * batch, when its complete lines were dropped) */
+void field_start_batch(struct field_extractor* ex, struct field_batch* batch, struct field_batch* prev) {
+  size_t partial_len = prev ? prev->len - prev->complete_len : 0;
+
+  if (partial_len) {
+    memmove(batch->data, prev->data + prev->complete_len, partial_len);
+  }
+  batch->truncating = prev ? prev->truncating : 0;
+  batch->next = NULL;
+  batch->rotations = 0;
+  batch->first_line = ex->line_number;
+  batch->lines = 0;
+  batch->complete_len = 0;
+  batch->len = partial_len;
+}
+
+/* Hand the complete lines of the current batch to the extraction thread.  This never waits:
+ * if the queue is full the lines are dropped, and the batch is refilled. */
+void field_handoff(struct field_extractor* ex) {
+  struct field_batch* batch = ex->batch;
+  struct field_batch* next = NULL;
+
+  if (!batch || (batch->lines == 0 && ex->pending_rotations == 0)) {
+    return;
+  }
+  pthread_mutex_lock(&ex->lock);
+  if (ex->queue_length < FIELD_QUEUE_LENGTH && ex->free) {
+    next = ex->free;
+    ex->free = next->next;
+  }
+  pthread_mutex_unlock(&ex->lock);
+
+  if (!next) {
+    ex->dropped += batch->lines;
+    PROBE1(field__drop, batch->lines);
+    field_start_batch(ex, batch, batch);
+    return;
+  }
+  field_start_batch(ex, next, batch);
+  batch->rotations = ex->pending_rotations;
+  batch->len = batch->complete_len;
+
+  pthread_mutex_lock(&ex->lock);
+  if (ex->tail) {
+    ex->tail->next = batch;
+  } else {
+    ex->head = batch;
+  }
+  ex->tail = batch;
+  ex->queue_length++;
+  pthread_cond_signal(&ex->cond);
+  pthread_mutex_unlock(&ex->lock);
+  ex->pending_rotations = 0;
+  ex->batch = next;
+}
+
+/* Copy a piece of an input line (ending the line if complete) into the current batch */
+void field_append(struct field_extractor* ex, const char* data, size_t len, int complete) {
+  struct field_batch* batch = ex->batch;
+  size_t room = 0;
+
+  if (batch->len + len > FIELD_BATCH_SIZE && batch->lines > 0) {
+    field_handoff(ex);
+    batch = ex->batch;
+  }
+
+  /* Truncate lines too long for a batch */
+  room = FIELD_BATCH_SIZE - batch->len - 1;
+  if (len - complete > room) {
+    batch->truncating = 1;
+  }
+  if (!batch->truncating || room > 0) {
+    size_t n = (len - complete < room) ? len - complete : room;
+    memcpy(batch->data + batch->len, data, n);
+    batch->len += n;
+  }
+
+  if (complete) {
+    batch->data[batch->len++] = '\n';
+    batch->complete_len = batch->len;
+    batch->lines++;
+    batch->truncating = 0;
+    ex->line_number++;
+  }
+}
+
+/* Note a log rotation, so the sidecar files rotate at the same line */
+void field_rotate(struct field_extractor* ex) {
+  field_handoff(ex);
+  ex->pending_rotations++;
+  ex->line_number = 1;
+  if (ex->batch) {
+    ex->batch->first_line = 1;
+  }
+}
+
+/* Open the sidecar file and start the extraction thread.  Returns 0 on success. */
+int field_start(struct field_extractor* ex, int do_append, long line_count) {
+  char name[MAX_FILENAME_LENGTH];
+
+  ex->columns = calloc(MAX_FIELD_COLUMNS, sizeof(*ex->columns));
+  ex->arena = malloc(FIELD_ARENA_SIZE);
+  ex->slots = malloc(2 * FIELD_BLOCK_ROWS * sizeof(*ex->slots));
+  ex->indexes = malloc(FIELD_BLOCK_ROWS * sizeof(*ex->indexes));
+  if (!ex->columns || !ex->arena || !ex->slots || !ex->indexes || field_pool_start(ex) != 0) {
+    eprint(0, "Failed to allocate field extraction buffers%s", "");
+    return 1;
+  }
+
+  if (do_append) {
+    snprintf(name, sizeof(name), "%s%s", ex->filename, FIELDS_SUFFIX);
+    ex->file = log_fopen(name, "a");
+    if (!ex->file) {
+      int err = errno;
+      eprint(err, "Failed to open field sidecar for append: %s", name);
+      return 1;
+    }
+  } else if (rotate_log(&ex->file, ex->filename, FIELDS_SUFFIX, ex->max_files) != 0) {
+    eprint(0, "Failed to initially rotate field sidecar%s", "");
+    return 1;
+  }
+  ex->line_number = line_count + 1;
+  ex->block_first_line = line_count + 1;
+  ex->batch = ex->free;
+  ex->free = ex->batch->next;
+  field_start_batch(ex, ex->batch, NULL);
+
+  pthread_mutex_init(&ex->lock, NULL);
+  pthread_cond_init(&ex->cond, NULL);
+  if (pthread_create(&ex->thread, NULL, field_thread, ex) != 0) {
+    eprint(0, "Failed to start field extraction thread%s", "");
+    return 1;
+  }
+  return 0;
+}
+
+/* Hand off the remaining lines, then wait for the extraction thread to finish */
+void field_stop(struct field_extractor* ex) {
+  /* A final line without a newline is still a line */
+  if (ex->batch && ex->batch->len > ex->batch->complete_len) {
+    field_append(ex, "\n", 1, 1);
+  }
+  field_handoff(ex);
+
+  pthread_mutex_lock(&ex->lock);
+  ex->done = 1;
+  pthread_cond_signal(&ex->cond);
+  pthread_mutex_unlock(&ex->lock);
+  pthread_join(ex->thread, NULL);
+
+  if (ex->dropped) {
+    wprint(0, "Field extraction fell behind, %llu lines were not extracted", ex->dropped);
+  }
+  if (ex->file && fclose(ex->file) != 0) {
+    int err = errno;
+    wprint(err, "Failed to close field sidecar%s", "");
+  }
+  if (ex->pool_mapped) {
+    munmap(ex->pool, ex->pool_mapped);
+  } else {
+    free(ex->pool);
+  }
+  free(ex->columns);
+  free(ex->arena);
+  free(ex->slots);
+  free(ex->indexes);
+  free(ex->out.data);
+}
+
+/* Read a varint from file into *v.  Returns 0 on success. */
+int fread_varint(FILE* file, unsigned long long* v) {
+  unsigned long long r = 0;
+  int shift = 0, c = 0;
+
+  while (shift < 64 && (c = fgetc(file)) != EOF) {
+    r |= (unsigned long long)(c & 0x7f) << shift;
+    if (!(c & 0x80)) {
+      *v = r;
+      return 0;
+    }
+    shift += 7;
+  }
+  return 1;
+}
+
+/* A column selected for reading from a field sidecar block */
+struct field_selection {
+  const char* name;
+  int type;
+  unsigned char* data;
+  unsigned long long len;
+  unsigned char present[FIELD_BLOCK_ROWS];
+  unsigned long long values[FIELD_BLOCK_ROWS];  /* integer, or offset of the dictionary entry */
+};
+
+/* Decode the rows of a selected column.  Returns 0 on success. */
+int field_decode_column(struct field_selection* sel, unsigned long long rows) {
+  const unsigned char* d = sel->data;
+  size_t pos = 0, len = sel->len;
+  unsigned long long v = 0, entries = 0, r = 0;
+  unsigned long long dict[FIELD_BLOCK_ROWS];
+  long long value = 0;
+
+  if (sel->type == FIELD_INT) {
+    pos = (rows + 7) / 8;
+    if (pos > len) {
+      return 1;
+    }
+    for (r = 0; r < rows; r++) {
+      sel->present[r] = (d[r / 8] >> (r % 8)) & 1;
+      if (sel->present[r]) {
+        if (get_varint(d, len, &pos, &v) != 0) {
+          return 1;
+        }
+        value += zigzag_decode(v);
+        sel->values[r] = (unsigned long long)value;
+      }
+    }
+    return 0;
+  }
+
+  if (get_varint(d, len, &pos, &entries) != 0 || entries > rows) {
+    return 1;
+  }
+  for (v = 0; v < entries; v++) {
+    unsigned long long n = 0;
+    dict[v] = pos;
+    if (get_varint(d, len, &pos, &n) != 0 || n > len - pos) {
+      return 1;
+    }
+    pos += n;
+  }
+  for (r = 0; r < rows; r++) {
+    if (get_varint(d, len, &pos, &v) != 0 || v > entries) {
+      return 1;
+    }
+    sel->present[r] = (v != 0);
+    sel->values[r] = v ? dict[v - 1] : 0;
+  }
+  return 0;
+}
+
+/* Print the selected columns of a field sidecar file, one row per line that has any of them,
+ * reading only those columns.  Without keys, list the columns of each block. */
+int fields_main(int argc, char** argv) {
+  struct field_selection* sel = NULL;
+  FILE* file = NULL;
+  int keys = argc - 2;
+  int ret = 0;
+  int k = 0;
+
+  if (argc < 2 || keys > MAX_FIELD_COLUMNS) {
+    eprint(0, "Usage: %s FILE%s [KEY]... (at most %d keys)", argv[0], FIELDS_SUFFIX, MAX_FIELD_COLUMNS);
+    return 1;
+  }
+  file = fopen(argv[1], "r");
+  if (!file) {
+    int err = errno;
+    eprint(err, "Failed to open field sidecar: %s", argv[1]);
+    return 1;
+  }
+  sel = calloc(keys ? keys : 1, sizeof(*sel));
+  if (!sel) {
+    eprint(0, "Failed to allocate field selection%s", "");
+    fclose(file);
+    return 1;
+  }
+  for (k = 0; k < keys; k++) {
+    sel[k].name = argv[2 + k];
+  }
+
+  while (ret == 0) {
+    unsigned long long first_line = 0, rows = 0, columns = 0, c = 0, r = 0;
+    char magic[4];
+
+    if (fread(magic, 1, 4, file) != 4) {
+      break;
+    }
+    if (memcmp(magic, "LJCB", 4) != 0 || fread_varint(file, &first_line) != 0 ||
+        fread_varint(file, &rows) != 0 || fread_varint(file, &columns) != 0 || rows > FIELD_BLOCK_ROWS) {
+      ret = 1;
+      break;
+    }
+
+    for (c = 0; c < columns && ret == 0; c++) {
+      unsigned long long name_len = 0, data_len = 0;
+      char name[MAX_FIELD_NAME_LENGTH + 1];
+      int type = 0;
+
+      if (fread_varint(file, &name_len) != 0 || name_len > MAX_FIELD_NAME_LENGTH ||
+          fread(name, 1, name_len, file) != name_len || (type = fgetc(file)) == EOF ||
+          fread_varint(file, &data_len) != 0) {
+        ret = 1;
+        break;
+      }
+      name[name_len] = '\0';
+
+      if (keys == 0) {
+        printf("%llu-%llu\t%s\t%s\t%llu\n", first_line, first_line + rows - 1, name,
+               (type == FIELD_INT) ? "int" : "string", data_len);
+      }
+      for (k = 0; k < keys; k++) {
+        if (!sel[k].data && strcmp(sel[k].name, name) == 0) {
+          break;
+        }
+      }
+      if (k == keys) {
+        if (fseek(file, data_len, SEEK_CUR) != 0) {
+          ret = 1;
+        }
+        continue;
+      }
+
+      sel[k].type = type;
+      sel[k].len = data_len;
+      sel[k].data = malloc(data_len ? data_len : 1);
+      if (!sel[k].data || fread(sel[k].data, 1, data_len, file) != data_len ||
+          field_decode_column(&sel[k], rows) != 0) {
+        ret = 1;
+      }
+    }
+
+    for (r = 0; r < rows && keys > 0 && ret == 0; r++) {
+      int present = 0;
+      for (k = 0; k < keys; k++) {
+        present |= sel[k].data && sel[k].present[r];
+      }
+      if (!present) {
+        continue;
+      }
+      printf("%llu", first_line + r);
+      for (k = 0; k < keys; k++) {
+        putchar('\t');
+        if (!sel[k].data || !sel[k].present[r]) {
+          continue;
+        }
+        if (sel[k].type == FIELD_INT) {
+          printf("%lld", (long long)sel[k].values[r]);
+        } else {
+          size_t pos = sel[k].values[r];
+          unsigned long long n = 0;
+          get_varint(sel[k].data, sel[k].len, &pos, &n);
+          fwrite(sel[k].data + pos, 1, n, stdout);
+        }
+      }
+      putchar('\n');
+    }
+
+    for (k = 0; k < keys; k++) {
+      free(sel[k].data);
+      sel[k].data = NULL;
+    }
+  }
+
+  if (ret) {
+    eprint(0, "Corrupt field sidecar: %s", argv[1]);
+  }
+  free(sel);
+  fclose(file);
+  return ret;
+}
+
+/* Days since 1970-01-01 of a proleptic Gregorian date */
+long long days_from_civil(long long y, unsigned m, unsigned d) {
+  long long era = 0;
+  unsigned yoe = 0, doy = 0, doe = 0;
+
+  y -= m <= 2;
+  era = (y >= 0 ? y : y - 399) / 400;
+  yoe = (unsigned)(y - era * 400);
+  doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + (long long)doe - 719468;
+}
+
+/* Proleptic Gregorian date of a number of days since 1970-01-01 */
+void civil_from_days(long long z, long long* y, unsigned* m, unsigned* d) {
+  long long era = 0;
+  unsigned doe = 0, yoe = 0, doy = 0, mp = 0;
+
+  z += 719468;
+  era = (z >= 0 ? z : z - 146096) / 146097;
+  doe = (unsigned)(z - era * 146097);
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp = (5 * doy + 2) / 153;
+  *d = doy - (153 * mp + 2) / 5 + 1;
+  *m = mp < 10 ? mp + 3 : mp - 9;
+  *y = (long long)yoe + era * 400 + (*m <= 2);
+}
+
+/* Write v in decimal at p, returning the end */
+char* put_uint(char* p, unsigned long long v) {
+  static const char digits[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+  char buf[20];
+  char* b = buf + sizeof(buf);
+  size_t n = 0;
+
+  while (v >= 100) {
+    b -= 2;
+    memcpy(b, digits + 2 * (v % 100), 2);
+    v /= 100;
+  }
+  if (v >= 10) {
+    b -= 2;
+    memcpy(b, digits + 2 * v, 2);
+  } else {
+    *--b = '0' + v;
+  }
+  n = buf + sizeof(buf) - b;
+  memcpy(p, b, n);
+  return p + n;
+}
+
+/* Write v in decimal at p, zero padded to width digits, returning the end */
+char* put_uint_padded(char* p, unsigned long long v, int width) {
+  int i = 0;
+  for (i = width - 1; i >= 0; i--) {
+    p[i] = '0' + v % 10;
+    v /= 10;
+  }
+  return p + width;
+}
+
+/* Kinds of prefix template operations */
+enum prefix_op_type {
+  PREFIX_LITERAL = 0,  /* static text, including hostname, pid and tag */
+  PREFIX_DATETIME,     /* %d local datetime, as written by -d */
+  PREFIX_UTC,          /* %u UTC in ISO-8601 */
+  PREFIX_EPOCH,        /* %e realtime epoch seconds with microseconds */
+  PREFIX_MONOTONIC,    /* %m monotonic seconds with microseconds, as written by -t */
+  PREFIX_SEQ,          /* %s sequence number of the line since starting */
+  PREFIX_LINE,         /* %n line number within the log file */
+  PREFIX_BATCH         /* %b index of the line among those sharing its clock sample (see -B) */
+};
+
+struct prefix_op {
+  enum prefix_op_type type;
+  size_t offset;  /* of literal text */
+  size_t len;
+};
+
+/* A line prefix template compiled into a list of operations, with all static parts
+ * (literal text, hostname, pid and tag) concatenated into single literals */
+struct prefix_template {
+  struct prefix_op ops[MAX_PREFIX_OPS];
+  int op_count;
+  char text[MAX_PREFIX_LENGTH];
+  size_t text_len;
+  int needs_realtime;
+  int needs_monotonic;
+  int per_line;  /* has parts that change every line (%s, %n or %b) */
+
+  /* With batch stamping, the prefix rendered for the current clock sample */
+  int batched;
+  char cache[MAX_PREFIX_RENDERED_LENGTH];
+  size_t cache_len;
+  int cache_valid;
+
+  /* Date and time to the second, rendered once per second */
+  long local_sec;
+  char local_str[MAX_TIMESTAMP_LENGTH];
+  size_t local_len;
+  long utc_sec;
+  char utc_str[MAX_TIMESTAMP_LENGTH];
+  size_t utc_len;
+};
+
+/* Values of the dynamic parts of a prefix */
+struct prefix_values {
+  struct timespec realtime;
+  struct timespec monotonic;
+  unsigned long long seq;
+  unsigned long long line;
+  unsigned long long batch;
+};
+
+/* Append static text to the template, merging it into a preceding literal.  Returns 0 on
+ * success. */
+int prefix_add_literal(struct prefix_template* t, const char* text, size_t len) {
+  struct prefix_op* last = t->op_count ? &t->ops[t->op_count - 1] : NULL;
+
+  if (len == 0) {
+    return 0;
+  }
+  if (t->text_len + len > MAX_PREFIX_LENGTH) {
+    return 1;
+  }
+  if (last && last->type == PREFIX_LITERAL) {
+    last->len += len;
+  } else {
+    if (t->op_count == MAX_PREFIX_OPS) {
+      return 1;
+    }
+    last = &t->ops[t->op_count++];
+    last->type = PREFIX_LITERAL;
+    last->offset = t->text_len;
+    last->len = len;
+  }
+  memcpy(t->text + t->text_len, text, len);
+  t->text_len += len;
+  return 0;
+}
+
+/* Compile template text (see print_usage()) and append it to t.  Returns 0 on success. */
+int prefix_compile(struct prefix_template* t, const char* template, const char* tag) {
+  const char* p = template;
+
+  t->local_sec = -1;
+  t->utc_sec = -1;
+  while (*p) {
+    const char* pct = strchr(p, '%');
+    char buf[64];
+    enum prefix_op_type type = PREFIX_LITERAL;
+
+    if (!pct) {
+      return prefix_add_literal(t, p, strlen(p));
+    }
+    if (prefix_add_literal(t, p, pct - p) != 0) {
+      return 1;
+    }
+    p = pct + 2;
+
+    switch (pct[1]) {
+      case '%':
+        if (prefix_add_literal(t, "%", 1) != 0) {
+          return 1;
+        }
+        continue;
+      case 'h':
+        if (gethostname(buf, sizeof(buf)) != 0) {
+          strcpy(buf, "localhost");
+        }
+        buf[sizeof(buf) - 1] = '\0';
+        if (prefix_add_literal(t, buf, strlen(buf)) != 0) {
+          return 1;
+        }
+        continue;
+      case 'p':
+        if (prefix_add_literal(t, buf, put_uint(buf, getpid()) - buf) != 0) {
+          return 1;
+        }
+        continue;
+      case 'T':
+        if (prefix_add_literal(t, tag, strlen(tag)) != 0) {
+          return 1;
+        }
+        continue;
+      case 'd': type = PREFIX_DATETIME; t->needs_realtime = 1; break;
+      case 'u': type = PREFIX_UTC; t->needs_realtime = 1; break;
+      case 'e': type = PREFIX_EPOCH; t->needs_realtime = 1; break;
+      case 'm': type = PREFIX_MONOTONIC; t->needs_monotonic = 1; break;
+      case 's': type = PREFIX_SEQ; t->per_line = 1; break;
+      case 'n': type = PREFIX_LINE; t->per_line = 1; break;
+      case 'b': type = PREFIX_BATCH; t->per_line = 1; break;
+      default:
+        eprint(0, "Invalid prefix template placeholder: %%%c", pct[1] ? pct[1] : ' ');
+        return 1;
+    }
+    if (t->op_count == MAX_PREFIX_OPS) {
+      return 1;
+    }
+    t->ops[t->op_count++].type = type;
+  }
+  return 0;
+}
+
+/* Take a new clock sample for rendering prefixes.  Batched templates sample both clocks, as
+ * the monotonic clock also measures the age of the sample. */
+void prefix_sample(struct prefix_template* t, struct prefix_values* v) {
+  if (t->needs_realtime || t->batched) {
+    clock_gettime(CLOCK_REALTIME, &v->realtime);
+  }
+  if (t->needs_monotonic || t->batched) {
+    clock_gettime(CLOCK_MONOTONIC, &v->monotonic);
+  }
+  v->batch = 0;
+  t->cache_valid = 0;
+}
+
+/* Take a new batch clock sample if the current one is more than max_usec old, checking only
+ * every BATCH_CHECK_LINES calls (or on the next call, after setting *check to one less) */
+void prefix_sample_batch(struct prefix_template* t, struct prefix_values* v, int* check, long long max_usec) {
+  struct timespec now = {0};
+
+  if (++*check < BATCH_CHECK_LINES) {
+    return;
+  }
+  *check = 0;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if ((now.tv_sec - v->monotonic.tv_sec) * 1000000LL +
+      (now.tv_nsec - v->monotonic.tv_nsec) / 1000 > max_usec) {
+    prefix_sample(t, v);
+  }
+}
+
+/* Whether stdio wrote out the buffer of file, and so may have blocked, while at least added
+ * bytes were written to it, given the bytes it had pending before */
+int stdio_wrote_out(FILE* file, size_t pending, size_t added) {
+  return __fpending(file) < pending + added;
+}
+
+/* Render the prefix into out (at least MAX_PREFIX_RENDERED_LENGTH bytes), returning its length.
+ * A batched prefix without per line parts is only rendered once per clock sample. */
+size_t prefix_render(struct prefix_template* t, const struct prefix_values* v, char* out) {
+  char* o = out;
+  int i = 0;
+
+  if (t->cache_valid) {
+    memcpy(out, t->cache, t->cache_len);
+    return t->cache_len;
+  }
+
+  for (i = 0; i < t->op_count; i++) {
+    const struct prefix_op* op = &t->ops[i];
+
+    switch (op->type) {
+      case PREFIX_LITERAL:
+        memcpy(o, t->text + op->offset, op->len);
+        o += op->len;
+        break;
+
+      case PREFIX_DATETIME:
+        if (v->realtime.tv_sec != t->local_sec) {
+          struct tm dt = {0};
+          localtime_r(&v->realtime.tv_sec, &dt);
+          t->local_len = snprintf(t->local_str, sizeof(t->local_str), "%d-%02d-%02d %02d:%02d:%02d.",
+                                  dt.tm_year+1900, dt.tm_mon+1, dt.tm_mday, dt.tm_hour, dt.tm_min, dt.tm_sec);
+          t->local_sec = v->realtime.tv_sec;
+        }
+        memcpy(o, t->local_str, t->local_len);
+        o = put_uint_padded(o + t->local_len, v->realtime.tv_nsec / 1000, 6);
+        break;
+
+      case PREFIX_UTC:
+        if (v->realtime.tv_sec != t->utc_sec) {
+          long long y = 0;
+          unsigned m = 0, d = 0, s = v->realtime.tv_sec % 86400;
+          civil_from_days(v->realtime.tv_sec / 86400, &y, &m, &d);
+          t->utc_len = snprintf(t->utc_str, sizeof(t->utc_str), "%lld-%02u-%02uT%02u:%02u:%02u.",
+                                y, m, d, s / 3600, (s / 60) % 60, s % 60);
+          t->utc_sec = v->realtime.tv_sec;
+        }
+        memcpy(o, t->utc_str, t->utc_len);
+        o = put_uint_padded(o + t->utc_len, v->realtime.tv_nsec / 1000, 6);
+        *o++ = 'Z';
+        break;
+
+      case PREFIX_EPOCH:
+        o = put_uint(o, v->realtime.tv_sec);
+        *o++ = '.';
+        o = put_uint_padded(o, v->realtime.tv_nsec / 1000, 6);
+        break;
+
+      case PREFIX_MONOTONIC:
+        o = put_uint(o, v->monotonic.tv_sec);
+        *o++ = '.';
+        o = put_uint_padded(o, v->monotonic.tv_nsec / 1000, 6);
+        break;
+
+      case PREFIX_SEQ:
+        o = put_uint(o, v->seq);
+        break;
+
+      case PREFIX_LINE:
+        o = put_uint(o, v->line);
+        break;
+
+      case PREFIX_BATCH:
+        o = put_uint(o, v->batch);
+        break;
+    }
+  }
+
+  if (t->batched && !t->per_line) {
+    t->cache_len = o - out;
+    memcpy(t->cache, out, t->cache_len);
+    t->cache_valid = 1;
+  }
+  return o - out;
+}
+
+/* Append text to template text, doubling any '%' if quote is set so it stays static text.
+ * Returns 0 on success, or 1 if it does not fit. */
+int prefix_append(char* template, size_t size, const char* text, int quote) {
+  size_t len = strlen(template);
+  for (; *text; text++) {
+    if (len + 2 >= size) {
+      return 1;
+    }
+    template[len++] = *text;
+    if (quote && *text == '%') {
+      template[len++] = '%';
+    }
+  }
+  template[len] = '\0';
+  return 0;
+}
+
+/* Kinds of line stamps recognized when archiving */
+enum stamp_kind {
+  STAMP_NONE = 0,
+  STAMP_DATETIME,  /* -d: "[YYYY-mm-dd HH:MM:SS.uuuuuu]: ", stored as civil microseconds */
+  STAMP_EPOCH      /* -t: "[sec.usec]: ", stored as microseconds */
+};
+
+/* Render a stamp of the given kind and value into buf (at least MAX_TIMESTAMP_LENGTH bytes),
+ * returning its length */
+int render_stamp(enum stamp_kind kind, long long us, char* buf) {
+  long long days = 0, y = 0, secs = 0;
+  unsigned m = 0, d = 0;
+
+  if (kind == STAMP_EPOCH) {
+    return snprintf(buf, MAX_TIMESTAMP_LENGTH, "[%lld.%06lld]: ", us / 1000000, us % 1000000);
+  }
+  days = us / 86400000000LL;
+  secs = (us % 86400000000LL) / 1000000;
+  civil_from_days(days, &y, &m, &d);
+  return snprintf(buf, MAX_TIMESTAMP_LENGTH, "[%lld-%02u-%02u %02lld:%02lld:%02lld.%06lld]: ",
+                  y, m, d, secs / 3600, (secs / 60) % 60, secs % 60, us % 1000000);
+}
+
+/* Parse n decimal digits at s into *v.  Returns 0 on success. */
+int parse_digits(const char* s, size_t n, long long* v) {
+  size_t i = 0;
+  *v = 0;
+  for (i = 0; i < n; i++) {
+    if (s[i] < '0' || s[i] > '9') {
+      return 1;
+    }
+    *v = *v * 10 + (s[i] - '0');
+  }
+  return 0;
+}
+
+/* Recognize a -d or -t stamp at the start of line, only accepting stamps that render back to
+ * exactly the same bytes.  Returns the stamp kind and sets *us and *stamp_len. */
+enum stamp_kind parse_stamp(const char* line, size_t len, long long* us, size_t* stamp_len) {
+  char buf[MAX_TIMESTAMP_LENGTH];
+  long long y = 0, mo = 0, d = 0, h = 0, mi = 0, s = 0, u = 0;
+  enum stamp_kind kind = STAMP_NONE;
+  size_t dot = 0;
+
+  if (len < 12 || line[0] != '[') {
+    return STAMP_NONE;
+  }
+
+  if (len >= 30 && line[5] == '-' && line[8] == '-' && line[11] == ' ' && line[14] == ':' &&
+      line[17] == ':' && line[20] == '.' && line[27] == ']' &&
+      parse_digits(line + 1, 4, &y) == 0 && parse_digits(line + 6, 2, &mo) == 0 &&
+      parse_digits(line + 9, 2, &d) == 0 && parse_digits(line + 12, 2, &h) == 0 &&
+      parse_digits(line + 15, 2, &mi) == 0 && parse_digits(line + 18, 2, &s) == 0 &&
+      parse_digits(line + 21, 6, &u) == 0 && mo >= 1 && mo <= 12 && d >= 1 && d <= 31) {
+    kind = STAMP_DATETIME;
+    *us = ((days_from_civil(y, mo, d) * 86400 + h * 3600 + mi * 60 + s) * 1000000) + u;
+  } else {
+    for (dot = 1; dot < len && dot < 20 && line[dot] != '.'; dot++);
+    if (dot == 1 || dot >= 20 || dot + 7 >= len || parse_digits(line + 1, dot - 1, &s) != 0 ||
+        parse_digits(line + dot + 1, 6, &u) != 0 || s > (LLONG_MAX - u) / 1000000) {
+      return STAMP_NONE;
+    }
+    kind = STAMP_EPOCH;
+    *us = s * 1000000 + u;
+  }
+
+  *stamp_len = render_stamp(kind, *us, buf);
+  if (*stamp_len > len || memcmp(buf, line, *stamp_len) != 0) {
+    return STAMP_NONE;
+  }
+  return kind;
+}
+
+/* Local time offsets for timestamps written by producers without a zone */
+struct line_time_parser {
+  long long hour;    /* local hour (since 1970-01-01 as if UTC) the offset is cached for, or -1 */
+  long long offset;  /* seconds to subtract from local time to get UTC */
+};
+
+/* Parse a timestamp already at the start of a line, optionally in brackets, from a fixed
+ * layout: ISO-8601 or RFC3339 "YYYY-mm-ddTHH:MM:SS[.frac][Z|+HH:MM|+HHMM]" (a space for the T,
+ * local time without a zone) or epoch seconds, milliseconds, microseconds or nanoseconds
+ * "s[.frac]".  The stamp must be followed by the end of the line, a bracket or a separator,
+ * and be no earlier than 1970.  Returns 0 and sets *ts on success. */
+int parse_line_time(struct line_time_parser* p, const char* line, size_t len, struct timespec* ts) {
+  long long y = 0, mo = 0, d = 0, h = 0, mi = 0, s = 0, ns = 0, zh = 0, zm = 0, secs = 0;
+  size_t i = (len > 0 && line[0] == '['), n = 0;
+  int zoned = 0;
+
+  if (len - i >= 19 && line[i + 4] == '-' && line[i + 7] == '-' &&
+      (line[i + 10] == 'T' || line[i + 10] == ' ' || line[i + 10] == 't') &&
+      line[i + 13] == ':' && line[i + 16] == ':' &&
+      parse_digits(line + i, 4, &y) == 0 && parse_digits(line + i + 5, 2, &mo) == 0 &&
+      parse_digits(line + i + 8, 2, &d) == 0 && parse_digits(line + i + 11, 2, &h) == 0 &&
+      parse_digits(line + i + 14, 2, &mi) == 0 && parse_digits(line + i + 17, 2, &s) == 0) {
+    if (mo < 1 || mo > 12 || d < 1 || d > 31 || h > 23 || mi > 59 || s > 60) {
+      return 1;
+    }
+    secs = days_from_civil(y, mo, d) * 86400 + h * 3600 + mi * 60 + s;
+    i += 19;
+  } else {
+    unsigned long long v = 0;
+
+    /* Only the lengths of the units are accepted, and 19 digits may not fit a long long */
+    for (n = 0; i + n < len && n < 20 && line[i + n] >= '0' && line[i + n] <= '9'; n++) {
+      v = v * 10 + (line[i + n] - '0');
+    }
+    if ((n != 10 && n != 13 && n != 16 && n != 19) || v > LLONG_MAX) {
+      return 1;
+    }
+    secs = (long long)v;
+    switch (n) {
+      case 13: ns = (secs % 1000) * 1000000; secs /= 1000; break;
+      case 16: ns = (secs % 1000000) * 1000; secs /= 1000000; break;
+      case 19: ns = secs % 1000000000; secs /= 1000000000; break;
+      default: break;
+    }
+    i += n;
+    zoned = 1;
+  }
+
+  /* Fraction of a second, to nanoseconds */
+  if (n != 13 && n != 16 && n != 19 && i + 1 < len && (line[i] == '.' || line[i] == ',') &&
+      line[i + 1] >= '0' && line[i + 1] <= '9') {
+    long long scale = 100000000;
+    for (i++; i < len && line[i] >= '0' && line[i] <= '9'; i++) {
+      ns += (line[i] - '0') * scale;
+      scale /= 10;
+    }
+  }
+
+  /* Zone of ISO-8601 times */
+  if (!zoned && i < len && (line[i] == 'Z' || line[i] == 'z')) {
+    zoned = 1;
+    i++;
+  } else if (!zoned && i + 5 <= len && (line[i] == '+' || line[i] == '-') &&
+             parse_digits(line + i + 1, 2, &zh) == 0) {
+    size_t m = i + 3 + (line[i + 3] == ':');
+    if (m + 2 > len || parse_digits(line + m, 2, &zm) != 0 || zh > 23 || zm > 59) {
+      return 1;
+    }
+    secs -= (line[i] == '+' ? 1 : -1) * (zh * 3600 + zm * 60);
+    zoned = 1;
+    i = m + 2;
+  }
+  if (i < len && line[i] != ' ' && line[i] != '\t' && line[i] != ']' && line[i] != '\n' &&
+      line[i] != '\r' && line[i] != ',' && line[i] != ';' && line[i] != '|') {
+    return 1;
+  }
+
+  /* Local times use the offset of their hour, only looked up when the hour changes */
+  if (!zoned) {
+    if (secs / 3600 != p->hour) {
+      struct tm tm = {0};
+      time_t local = 0;
+      tm.tm_year = y - 1900;
+      tm.tm_mon = mo - 1;
+      tm.tm_mday = d;
+      tm.tm_hour = h;
+      tm.tm_isdst = -1;
+      local = mktime(&tm);
+      if (local == (time_t)-1) {
+        return 1;
+      }
+      p->hour = secs / 3600;
+      p->offset = p->hour * 3600 - (long long)local;
+    }
+    secs -= p->offset;
+  }
+
+  /* Times before 1970 are not rendered, so the line takes the time it arrived */
+  if (secs < 0) {
+    return 1;
+  }
+  ts->tv_sec = secs;
+  ts->tv_nsec = ns;
+  return 0;
+}
+
+/* Columns of an archive block */
+enum archive_column {
+  ARCHIVE_TEMPLATES = 0,  /* templates first used in this block: length and text of each */
+  ARCHIVE_STAMP_KIND,     /* one stamp_kind byte per line */
+  ARCHIVE_STAMP_DELTA,    /* zigzag delta from the previous stamp of the block, per stamped line */
+  ARCHIVE_TEMPLATE_ID,    /* template of each line, 0 for a line stored whole as one parameter */
+  ARCHIVE_PARAM_LENGTH,   /* length of each parameter */
+  ARCHIVE_PARAM_DATA,     /* parameter bytes */
+  ARCHIVE_COLUMNS
+};
+
+/* Column codecs */
+enum archive_codec {
+  ARCHIVE_STORED = 0,
+  ARCHIVE_DEFLATE
+};
+
+/* Retired log files converted to archives by a background thread */
+struct archiver {
+  const char* dir;
+  const char* basename;
+  unsigned long long dropped;  /* retired files not archived because the queue was full */
+
+  /* Queue of open retired log files, protected by lock */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int fds[ARCHIVE_QUEUE_LENGTH];
+  int head;
+  int count;
+  int done;
+  pthread_t thread;
+
+  /* Archive being written by the thread */
+  unsigned long long archives;
+  struct byte_buffer columns[ARCHIVE_COLUMNS];
+  struct byte_buffer templates;       /* text of every template */
+  struct byte_buffer template_slots;  /* hash table of template offset + 1 */
+  size_t template_offsets[ARCHIVE_MAX_TEMPLATES];
+  size_t template_count;
+  struct byte_buffer line;            /* template of the current line */
+  struct byte_buffer out;
+  size_t block_lines;
+  long long last_stamp;
+};
+
+/* Look up the template of the current line, adding it if new.  Returns its id (1 based), or 0
+ * if the template table is full. */
+size_t archive_template_id(struct archiver* ar) {
+  size_t* slots = (size_t*)ar->template_slots.data;
+  size_t mask = 2 * ARCHIVE_MAX_TEMPLATES - 1;
+  size_t slot = hash_bytes((char*)ar->line.data, ar->line.len) & mask;
+  size_t offset = 0;
+
+  while (slots[slot]) {
+    size_t id = slots[slot];
+    size_t start = ar->template_offsets[id - 1];
+    size_t end = (id < ar->template_count) ? ar->template_offsets[id] : ar->templates.len;
+    if (end - start == ar->line.len && memcmp(ar->templates.data + start, ar->line.data, ar->line.len) == 0) {
+      return id;
+    }
+    slot = (slot + 1) & mask;
+  }
+  if (ar->template_count == ARCHIVE_MAX_TEMPLATES) {
+    return 0;
+  }
+
+  offset = ar->templates.len;
+  if (buffer_append(&ar->templates, ar->line.data, ar->line.len) != 0 ||
+      buffer_append_varint(&ar->columns[ARCHIVE_TEMPLATES], ar->line.len) != 0 ||
+      buffer_append(&ar->columns[ARCHIVE_TEMPLATES], ar->line.data, ar->line.len) != 0) {
+    return 0;
+  }
+  ar->template_offsets[ar->template_count++] = offset;
+  slots[slot] = ar->template_count;
+  return ar->template_count;
+}
+
+int archive_add_param(struct archiver* ar, const char* data, size_t len) {
+  return buffer_append_varint(&ar->columns[ARCHIVE_PARAM_LENGTH], len) |
+         buffer_append(&ar->columns[ARCHIVE_PARAM_DATA], data, len);
+}
+
+/* Split a line (without its newline) into its stamp, template and parameters.  Tokens
+ * containing a digit are parameters, keeping a "key=" at their start in the template. */
+int archive_add_line(struct archiver* ar, const char* line, size_t len) {
+  struct byte_buffer* col = ar->columns;
+  size_t params_start = col[ARCHIVE_PARAM_LENGTH].len;
+  size_t data_start = col[ARCHIVE_PARAM_DATA].len;
+  size_t stamp_len = 0, i = 0, id = 0;
+  unsigned char kind = STAMP_NONE;
+  long long us = 0;
+  int failed = 0;
+
+  kind = parse_stamp(line, len, &us, &stamp_len);
+  failed |= buffer_append(&col[ARCHIVE_STAMP_KIND], &kind, 1);
+  if (kind != STAMP_NONE) {
+    failed |= buffer_append_varint(&col[ARCHIVE_STAMP_DELTA], zigzag_encode(us - ar->last_stamp));
+    ar->last_stamp = us;
+    line += stamp_len;
+    len -= stamp_len;
+  }
+
+  ar->line.len = 0;
+  if (len <= ARCHIVE_MAX_TEMPLATE_LENGTH && !memchr(line, ARCHIVE_PARAM_MARKER, len)) {
+    while (i < len && !failed) {
+      size_t start = i, split = 0;
+      int has_digit = 0;
+
+      for (; i < len && line[i] != ' '; i++) {
+        has_digit |= (line[i] >= '0' && line[i] <= '9');
+        if (!split && !has_digit && line[i] == '=') {
+          split = i - start + 1;
+        }
+      }
+      if (has_digit) {
+        char marker = ARCHIVE_PARAM_MARKER;
+        failed |= buffer_append(&ar->line, line + start, split);
+        failed |= buffer_append(&ar->line, &marker, 1);
+        failed |= archive_add_param(ar, line + start + split, i - start - split);
+      } else {
+        failed |= buffer_append(&ar->line, line + start, i - start);
+      }
+      for (start = i; i < len && line[i] == ' '; i++);
+      failed |= buffer_append(&ar->line, line + start, i - start);
+    }
+    id = failed ? 0 : archive_template_id(ar);
+  }
+
+  /* Without a template, the whole line is the only parameter */
+  if (id == 0) {
+    col[ARCHIVE_PARAM_LENGTH].len = params_start;
+    col[ARCHIVE_PARAM_DATA].len = data_start;
+    failed |= archive_add_param(ar, line, len);
+  }
+  failed |= buffer_append_varint(&col[ARCHIVE_TEMPLATE_ID], id);
+  ar->block_lines++;
+  return failed;
+}
+
+/* Write the current block to file and start a new one.  Block layout (integers are varints):
+ *   "LJAB" lines flags columns
+ *   per column: codec raw_len stored_len data
+ * flags bit 0 is set if the last line has no newline.  Returns 0 on success. */
+int archive_flush_block(struct archiver* ar, FILE* file, int unterminated) {
+  struct byte_buffer* out = &ar->out;
+  int failed = 0, i = 0;
+
+  out->len = 0;
+  failed |= buffer_append(out, "LJAB", 4);
+  failed |= buffer_append_varint(out, ar->block_lines);
+  failed |= buffer_append_varint(out, unterminated ? 1 : 0);
+  failed |= buffer_append_varint(out, ARCHIVE_COLUMNS);
+
+  for (i = 0; i < ARCHIVE_COLUMNS && !failed; i++) {
+    struct byte_buffer* col = &ar->columns[i];
+    unsigned char codec = ARCHIVE_STORED;
+    size_t stored_len = col->len;
+
+#ifdef HAVE_ZLIB
+    uLongf dest_len = compressBound(col->len);
+    size_t header_pos = out->len;
+    failed |= buffer_reserve(out, 21 + dest_len);
+    if (!failed && col->len > 64 &&
+        compress2(out->data + header_pos + 21, &dest_len, col->data, col->len, ARCHIVE_DEFLATE_LEVEL) == Z_OK &&
+        dest_len < col->len) {
+      /* Compressed in place after room for the header, then moved up against it */
+      unsigned char header[21];
+      size_t n = 1;
+      header[0] = ARCHIVE_DEFLATE;
+      n += put_varint(header + n, col->len);
+      n += put_varint(header + n, dest_len);
+      memmove(out->data + header_pos + n, out->data + header_pos + 21, dest_len);
+      memcpy(out->data + header_pos, header, n);
+      out->len += n + dest_len;
+      col->len = 0;
+      continue;
+    }
+#endif
+
+    failed |= buffer_append(out, &codec, 1);
+    failed |= buffer_append_varint(out, col->len);
+    failed |= buffer_append_varint(out, stored_len);
+    failed |= buffer_append(out, col->data, col->len);
+    col->len = 0;
+  }
+
+  for (i = 0; i < ARCHIVE_COLUMNS; i++) {
+    ar->columns[i].len = 0;
+  }
+  ar->block_lines = 0;
+  ar->last_stamp = 0;
+
+  if (failed || fwrite(out->data, 1, out->len, file) != out->len) {
+    return 1;
+  }
+  return 0;
+}
+
+/* Convert the retired log file open as fd into a new archive in the archive directory */
+void archive_convert(struct archiver* ar, int fd) {
+  char tmp_name[MAX_FILENAME_LENGTH + 8];
+  char name[MAX_FILENAME_LENGTH];
+  FILE* in = fdopen(fd, "r");
+  FILE* out = NULL;
+  char* line = NULL;
+  size_t line_size = 0;
+  ssize_t len = 0;
+  int failed = 0, unterminated = 0, i = 0;
+
+  if (!in) {
+    int err = errno;
+    wprint(err, "Failed to read retired log file for archiving%s", "");
+    close(fd);
+    return;
+  }
+
+  /* Name archives by the time they are written, written under a temporary name until complete */
+  do {
+    struct stat sb = {0};
+    snprintf(name, sizeof(name), "%s/%s.%ld.%llu%s", ar->dir, ar->basename, (long)time(NULL),
+             ar->archives++, ARCHIVE_SUFFIX);
+    if (stat(name, &sb) != 0) {
+      break;
+    }
+  } while (1);
+  snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", name);
+  out = fopen(tmp_name, "w");
+  if (!out) {
+    int err = errno;
+    wprint(err, "Failed to create archive: %s", tmp_name);
+    fclose(in);
+    return;
+  }
+
+  /* Templates are numbered per archive */
+  ar->template_count = 0;
+  ar->templates.len = 0;
+  memset(ar->template_slots.data, 0, ar->template_slots.len);
+
+  failed |= fwrite(ARCHIVE_MAGIC, 1, strlen(ARCHIVE_MAGIC), out) != strlen(ARCHIVE_MAGIC);
+  while (!failed && (len = getline(&line, &line_size, in)) > 0) {
+    size_t block_bytes = 0;
+
+    /* Keep each column of a block within what archive_read_block() accepts */
+    if (len > ARCHIVE_MAX_COLUMN_LENGTH - ARCHIVE_BLOCK_BYTES) {
+      failed = 1;
+      errno = EFBIG;
+      break;
+    }
+    unterminated = (line[len - 1] != '\n');
+    failed |= archive_add_line(ar, line, len - !unterminated);
+    for (i = 0; i < ARCHIVE_COLUMNS; i++) {
+      block_bytes += ar->columns[i].len;
+    }
+    if (ar->block_lines == ARCHIVE_BLOCK_LINES || block_bytes >= ARCHIVE_BLOCK_BYTES) {
+      failed |= archive_flush_block(ar, out, unterminated);
+    }
+  }
+  if (!failed && ar->block_lines) {
+    failed |= archive_flush_block(ar, out, unterminated);
+  }
+  free(line);
+  fclose(in);
+
+  if (fclose(out) != 0) {
+    failed = 1;
+  }
+  if (failed || rename(tmp_name, name) != 0) {
+    int err = errno;
+    wprint(err, "Failed to write archive: %s", name);
+    unlink(tmp_name);
+  }
+  for (len = 0; len < ARCHIVE_COLUMNS; len++) {
+    ar->columns[len].len = 0;
+  }
+  ar->block_lines = 0;
+  ar->last_stamp = 0;
+}
+
+void* archive_thread(void* arg) {
+  struct archiver* ar = arg;
+
+  while (1) {
+    int fd = -1;
+    long long start_ns = 0;
+
+    pthread_mutex_lock(&ar->lock);
+    while (!ar->count && !ar->done) {
+      pthread_cond_wait(&ar->cond, &ar->lock);
+    }
+    if (ar->count) {
+      fd = ar->fds[ar->head];
+      ar->head = (ar->head + 1) % ARCHIVE_QUEUE_LENGTH;
+      ar->count--;
+    }
+    pthread_mutex_unlock(&ar->lock);
+
+    if (fd < 0) {
+      break;
+    }
+    start_ns = trace_now();
+    archive_convert(ar, fd);
+    trace_span(TRACE_ARCHIVE, "archive", start_ns);
+  }
+  return NULL;
+}
+
+/* Start the archive thread.  Returns 0 on success. */
+int archive_start(struct archiver* ar, const char* filename) {
+  struct stat sb = {0};
+  const char* slash = strrchr(filename, '/');
+
+  if (stat(ar->dir, &sb) != 0 || !S_ISDIR(sb.st_mode)) {
+    eprint(0, "Archive directory does not exist: %s", ar->dir);
+    return 1;
+  }
+  ar->basename = slash ? slash + 1 : filename;
+  if (strlen(ar->dir) + strlen(ar->basename) + 64 >= MAX_FILENAME_LENGTH) {
+    eprint(0, "Archive directory name too long%s", "");
+    return 1;
+  }
+  if (buffer_reserve(&ar->template_slots, 2 * ARCHIVE_MAX_TEMPLATES * sizeof(size_t)) != 0) {
+    eprint(0, "Failed to allocate archive template table%s", "");
+    return 1;
+  }
+  ar->template_slots.len = 2 * ARCHIVE_MAX_TEMPLATES * sizeof(size_t);
+
+  pthread_mutex_init(&ar->lock, NULL);
+  pthread_cond_init(&ar->cond, NULL);
+  if (pthread_create(&ar->thread, NULL, archive_thread, ar) != 0) {
+    eprint(0, "Failed to start archive thread%s", "");
+    return 1;
+  }
+  return 0;
+}
+
+/* Queue a retired log file, open as fd, to be archived.  This never waits: if the queue is
+ * full, the file is not archived. */
+void archive_retired(struct archiver* ar, int fd) {
+  int queued = 0;
+
+  pthread_mutex_lock(&ar->lock);
+  if (ar->count < ARCHIVE_QUEUE_LENGTH) {
+    ar->fds[(ar->head + ar->count) % ARCHIVE_QUEUE_LENGTH] = fd;
+    ar->count++;
+    queued = 1;
+    pthread_cond_signal(&ar->cond);
+  }
+  pthread_mutex_unlock(&ar->lock);
+
+  if (!queued) {
+    wprint(0, "Archiving fell behind, a retired log file was not archived%s", "");
+    ar->dropped++;
+    PROBE1(archive__drop, ar->dropped);
+    close(fd);
+  }
+}
+
+/* Finish archiving the queued files and stop the archive thread */
+void archive_stop(struct archiver* ar) {
+  int i = 0;
+
+  pthread_mutex_lock(&ar->lock);
+  ar->done = 1;
+  pthread_cond_signal(&ar->cond);
+  pthread_mutex_unlock(&ar->lock);
+  pthread_join(ar->thread, NULL);
+
+  for (i = 0; i < ARCHIVE_COLUMNS; i++) {
+    free(ar->columns[i].data);
+  }
+  free(ar->templates.data);
+  free(ar->template_slots.data);
+  free(ar->line.data);
+  free(ar->out.data);
+}
+
+/* Read the columns of the next archive block into cols.  Returns 1 if a block was read, 0 at
+ * the end of the file and -1 on error. */
+int archive_read_block(FILE* file, struct byte_buffer* cols, unsigned long long* lines, unsigned long long* flags) {
+  unsigned long long columns = 0, codec = 0, raw_len = 0, stored_len = 0;
+  char magic[4];
+  int i = 0;
+
+  if (fread(magic, 1, 4, file) != 4) {
+    return 0;
+  }
+  if (memcmp(magic, "LJAB", 4) != 0 || fread_varint(file, lines) != 0 || fread_varint(file, flags) != 0 ||
+      fread_varint(file, &columns) != 0 || columns != ARCHIVE_COLUMNS) {
+    return -1;
+  }
+
+  for (i = 0; i < ARCHIVE_COLUMNS; i++) {
+    cols[i].len = 0;
+    if ((codec = fgetc(file)) > ARCHIVE_DEFLATE || fread_varint(file, &raw_len) != 0 ||
+        fread_varint(file, &stored_len) != 0) {
+      return -1;
+    }
+    /* The lengths are from the file, so bound them before reserving room for both */
+    if (raw_len > ARCHIVE_MAX_COLUMN_LENGTH || (codec == ARCHIVE_STORED && stored_len != raw_len) ||
+#ifdef HAVE_ZLIB
+        (codec == ARCHIVE_DEFLATE && stored_len > compressBound(raw_len)) ||
+#endif
+        stored_len > SIZE_MAX - raw_len) {
+      return -1;
+    }
+    if (buffer_reserve(&cols[i], raw_len + stored_len) != 0 ||
+        fread(cols[i].data + raw_len, 1, stored_len, file) != stored_len) {
+      return -1;
+    }
+    if (codec == ARCHIVE_STORED) {
+      memmove(cols[i].data, cols[i].data + raw_len, stored_len);
+    } else {
+#ifdef HAVE_ZLIB
+      uLongf dest_len = raw_len;
+      if (uncompress(cols[i].data, &dest_len, cols[i].data + raw_len, stored_len) != Z_OK || dest_len != raw_len) {
+        return -1;
+      }
+#else
+      eprint(0, "Archive is compressed, but lumberjack was built without zlib%s", "");
+      return -1;
+#endif
+    }
+    cols[i].len = raw_len;
+  }
+  return 1;
+}
+
+/* Write the next parameter of an archive block.  Returns 0 on success. */
+int archive_write_param(struct byte_buffer* cols, size_t* pos, FILE* out) {
+  unsigned long long n = 0;
+
+  if (get_varint(cols[ARCHIVE_PARAM_LENGTH].data, cols[ARCHIVE_PARAM_LENGTH].len, &pos[ARCHIVE_PARAM_LENGTH], &n) != 0 ||
+      n > cols[ARCHIVE_PARAM_DATA].len - pos[ARCHIVE_PARAM_DATA]) {
+    return 1;
+  }
+  fwrite(cols[ARCHIVE_PARAM_DATA].data + pos[ARCHIVE_PARAM_DATA], 1, n, out);
+  pos[ARCHIVE_PARAM_DATA] += n;
+  return 0;
+}
+
+/* Render an archive back to the original log text */
+int archive_cat(const char* in_filename, FILE* out) {
+  struct byte_buffer cols[ARCHIVE_COLUMNS] = {{0}};
+  struct byte_buffer templates = {0};
+  size_t* offsets = NULL;   /* start of each template, with the end of the last at the end */
+  size_t template_count = 0;
+  char magic[sizeof(ARCHIVE_MAGIC) - 1];
+  FILE* file = fopen(in_filename, "r");
+  int ret = 0, r = 0, i = 0;
+
+  if (!file) {
+    int err = errno;
+    eprint(err, "Failed to open archive: %s", in_filename);
+    return 1;
+  }
+  offsets = malloc((ARCHIVE_MAX_TEMPLATES + 1) * sizeof(*offsets));
+  if (!offsets || fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+      memcmp(magic, ARCHIVE_MAGIC, sizeof(magic)) != 0) {
+    ret = 1;
+    goto done;
+  }
+  offsets[0] = 0;
+
+  while (ret == 0) {
+    unsigned long long lines = 0, flags = 0, n = 0, l = 0;
+    size_t pos[ARCHIVE_COLUMNS] = {0};
+    long long stamp = 0;
+
+    r = archive_read_block(file, cols, &lines, &flags);
+    if (r <= 0) {
+      ret = (r < 0);
+      break;
+    }
+
+    /* Add the new templates to the table */
+    while (pos[ARCHIVE_TEMPLATES] < cols[ARCHIVE_TEMPLATES].len) {
+      if (get_varint(cols[ARCHIVE_TEMPLATES].data, cols[ARCHIVE_TEMPLATES].len, &pos[ARCHIVE_TEMPLATES], &n) != 0 ||
+          n > cols[ARCHIVE_TEMPLATES].len - pos[ARCHIVE_TEMPLATES] || template_count == ARCHIVE_MAX_TEMPLATES ||
+          buffer_append(&templates, cols[ARCHIVE_TEMPLATES].data + pos[ARCHIVE_TEMPLATES], n) != 0) {
+        ret = 1;
+        break;
+      }
+      pos[ARCHIVE_TEMPLATES] += n;
+      offsets[++template_count] = templates.len;
+    }
+
+    for (l = 0; l < lines && ret == 0; l++) {
+      unsigned long long id = 0, delta = 0;
+      int kind = 0;
+
+      if (pos[ARCHIVE_STAMP_KIND] >= cols[ARCHIVE_STAMP_KIND].len ||
+          get_varint(cols[ARCHIVE_TEMPLATE_ID].data, cols[ARCHIVE_TEMPLATE_ID].len, &pos[ARCHIVE_TEMPLATE_ID], &id) != 0 ||
+          id > template_count) {
+        ret = 1;
+        break;
+      }
+      kind = cols[ARCHIVE_STAMP_KIND].data[pos[ARCHIVE_STAMP_KIND]++];
+      if (kind != STAMP_NONE) {
+        char buf[MAX_TIMESTAMP_LENGTH];
+        if (get_varint(cols[ARCHIVE_STAMP_DELTA].data, cols[ARCHIVE_STAMP_DELTA].len, &pos[ARCHIVE_STAMP_DELTA], &delta) != 0) {
+          ret = 1;
+          break;
+        }
+        stamp += zigzag_decode(delta);
+        fwrite(buf, 1, render_stamp(kind, stamp, buf), out);
+      }
+
+      /* Fill the parameters into the template, or write the line stored whole */
+      if (id == 0) {
+        ret = archive_write_param(cols, pos, out);
+      } else {
+        const unsigned char* t = templates.data + offsets[id - 1];
+        const unsigned char* end = templates.data + offsets[id];
+        for (; t < end && ret == 0; t++) {
+          if (*t == ARCHIVE_PARAM_MARKER) {
+            ret = archive_write_param(cols, pos, out);
+          } else {
+            putc(*t, out);
+          }
+        }
+      }
+      if (l + 1 < lines || !(flags & 1)) {
+        putc('\n', out);
+      }
+    }
+  }
+
+  done:
+    if (ret) {
+      eprint(0, "Corrupt archive: %s", in_filename);
+    }
+    for (i = 0; i < ARCHIVE_COLUMNS; i++) {
+      free(cols[i].data);
+    }
+    free(templates.data);
+    free(offsets);
+    fclose(file);
+    return ret;
+}
+
+/* Current realtime clock in microseconds */
+long long realtime_us(void) {
+  struct timespec ts = {0};
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* State of a binary log file.  A binary log file is BINARY_MAGIC followed by varints of the
+ * start time (realtime microseconds) and the sequence number before its first line, then a
+ * record per line:
+ *   varint   payload length << 1, | 1 if the line has no newline (it continues in the next record)
+ *   varint   zigzag microseconds since the previous record (or start time)
+ *   varint   sequence number increment from the previous record
+ *   payload  the line without its newline */
+struct binary_log {
+  long long last_us;
+  unsigned long long last_seq;
+
+  /* Line being collected into a record */
+  char* record;
+  size_t record_len;
+  long long record_us;  /* time the line started */
+  int record_ready;     /* complete or full, waiting to be written */
+  int record_complete;  /* ended by a newline */
+};
+
+/* Write the header of a new binary log file.  Returns 0 on success. */
+int binary_start(FILE* file, struct binary_log* b, unsigned long long seq) {
+  unsigned char header[sizeof(BINARY_MAGIC) - 1 + 20];
+  size_t n = sizeof(BINARY_MAGIC) - 1;
+
+  b->last_us = realtime_us();
+  b->last_seq = seq;
+  memcpy(header, BINARY_MAGIC, n);
+  n += put_varint(header + n, b->last_us);
+  n += put_varint(header + n, seq);
+  return fwrite(header, 1, n, file) != n;
+}
+
+/* Write the collected line as a record.  Returns 0 on success. */
+int binary_write_record(FILE* file, struct binary_log* b, unsigned long long seq) {
+  unsigned char header[30];
+  size_t n = 0;
+
+  n += put_varint(header + n, ((unsigned long long)b->record_len << 1) | !b->record_complete);
+  n += put_varint(header + n, zigzag_encode(b->record_us - b->last_us));
+  n += put_varint(header + n, seq - b->last_seq);
+  if (fwrite(header, 1, n, file) != n || fwrite(b->record, 1, b->record_len, file) != b->record_len) {
+    return 1;
+  }
+  b->last_us = b->record_us;
+  b->last_seq = seq;
+  return 0;
+}
+
+/* Use the timestamp at the start of the collected record, if it has one, as its time */
+void binary_embedded_time(struct binary_log* b, struct line_time_parser* p) {
+  struct timespec ts = {0};
+
+  if (parse_line_time(p, b->record, b->record_len, &ts) == 0) {
+    b->record_us = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+}
+
+/* Read the next record header from file.  Returns 1 if a record was read, 0 at the end of the
+ * file and -1 if the file ends inside a header. */
+int binary_read_record(FILE* file, unsigned long long* len, int* complete, long long* us, unsigned long long* seq) {
+  unsigned long long v = 0;
+  int c = fgetc(file);
+
+  if (c == EOF) {
+    return 0;
+  }
+  ungetc(c, file);
+  if (fread_varint(file, &v) != 0) {
+    return -1;
+  }
+  *len = v >> 1;
+  *complete = !(v & 1);
+  if (fread_varint(file, &v) != 0) {
+    return -1;
+  }
+  *us += zigzag_decode(v);
+  if (fread_varint(file, &v) != 0) {
+    return -1;
+  }
+  *seq += v;
+  return 1;
+}
+
+/* Read the binary log file being appended to, counting its lines and picking up where it
+ * left off.  A record torn by a crash is truncated, and like text files, a final line without
+ * a newline is ended.  Returns 0 on success. */
+int binary_resume(FILE* file, struct binary_log* b, int* line_count, unsigned long long* seq) {
+  unsigned long long len = 0;
+  unsigned long long seq_read = 0;
+  char magic[sizeof(BINARY_MAGIC) - 1];
+  long good = 0, last = -1;
+  long long us = 0;
+  int complete = 1, record_complete = 1;
+
+  rewind(file);
+  if (fread(magic, 1, sizeof(magic), file) != sizeof(magic)) {
+    /* Empty (or torn before its header), so start over */
+    if (ftruncate(log_fileno(file), 0) != 0) {
+      return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    return binary_start(file, b, *seq);
+  }
+  if (memcmp(magic, BINARY_MAGIC, sizeof(magic)) != 0 ||
+      fread_varint(file, (unsigned long long*)&b->last_us) != 0 || fread_varint(file, &b->last_seq) != 0) {
+    eprint(0, "Log file to append is not a binary log file%s", "");
+    return 1;
+  }
+
+  good = ftell(file);
+  us = b->last_us;
+  seq_read = b->last_seq;
+  while (binary_read_record(file, &len, &record_complete, &us, &seq_read) > 0) {
+    long end = ftell(file) + (long)len;
+    if (fseek(file, 0, SEEK_END) != 0 || ftell(file) < end) {
+      break;
+    }
+    fseek(file, end, SEEK_SET);
+    last = good;
+    good = end;
+    complete = record_complete;
+    b->last_us = us;
+    b->last_seq = seq_read;
+    *line_count += complete;
+  }
+
+  /* Drop anything after the last complete record */
+  fseek(file, 0, SEEK_END);
+  if (ftell(file) != good) {
+    wprint(0, "Truncating torn record at the end of the binary log file%s", "");
+    if (ftruncate(log_fileno(file), good) != 0) {
+      return 1;
+    }
+    fseek(file, 0, SEEK_END);
+  }
+
+  /* The flag for a line without a newline is the low bit of the first header byte.  Linux
+   * ignores the offset of pwrite() in append mode, so append mode is dropped to update it. */
+  if (last >= 0 && !complete) {
+    int fd = log_fileno(file);
+    int flags = fcntl(fd, F_GETFL);
+    unsigned char first = 0;
+    if (flags < 0 || pread(fd, &first, 1, last) != 1 || fcntl(fd, F_SETFL, flags & ~O_APPEND) != 0) {
+      return 1;
+    }
+    first &= ~1;
+    if (pwrite(fd, &first, 1, last) != 1 || fcntl(fd, F_SETFL, flags) != 0) {
+      return 1;
+    }
+    (*line_count)++;
+  }
+  *seq = b->last_seq;
+  return 0;
+}
+
+/* Stamps to render in front of each line of a binary log file */
+enum cat_stamp {
+  CAT_DATETIME = 1,  /* local datetime, as written by -d */
+  CAT_UTC = 2,       /* UTC in ISO-8601 */
+  CAT_EPOCH = 4,     /* realtime epoch */
+  CAT_SEQ = 8        /* sequence number */
+};
+
+/* Render a binary log file (after its magic) as text */
+int binary_cat(FILE* file, int stamps, FILE* out) {
+  unsigned long long len = 0, seq = 0;
+  long long us = 0, local_sec = -1;
+  struct tm dt = {0};
+  char* payload = NULL;
+  size_t payload_size = 0;
+  int complete = 1, line_start = 1, r = 0;
+
+  if (fread_varint(file, (unsigned long long*)&us) != 0 || fread_varint(file, &seq) != 0) {
+    return 1;
+  }
+
+  while ((r = binary_read_record(file, &len, &complete, &us, &seq)) > 0) {
+    long long sec = us / 1000000, usec = us % 1000000;
+
+    /* Round down, so a time before 1970 still has its time of day */
+    if (usec < 0) {
+      sec--;
+      usec += 1000000;
+    }
+    if (len > payload_size) {
+      char* p = realloc(payload, len);
+      if (!p) {
+        r = -1;
+        break;
+      }
+      payload = p;
+      payload_size = len;
+    }
+    if (fread(payload, 1, len, file) != len) {
+      r = -1;
+      break;
+    }
+
+    /* Stamps are only rendered at the start of a line, not on its continuations */
+    if (line_start) {
+      if (stamps & CAT_DATETIME) {
+        if (sec != local_sec) {
+          time_t t = sec;
+          localtime_r(&t, &dt);
+          local_sec = sec;
+        }
+        fprintf(out, "[%d-%02d-%02d %02d:%02d:%02d.%06lld]: ", dt.tm_year+1900, dt.tm_mon+1, dt.tm_mday,
+                dt.tm_hour, dt.tm_min, dt.tm_sec, usec);
+      }
+      if (stamps & CAT_UTC) {
+        long long y = 0, days = sec / 86400 - (sec % 86400 < 0);
+        unsigned m = 0, d = 0, s = sec - days * 86400;
+        civil_from_days(days, &y, &m, &d);
+        fprintf(out, "%lld-%02u-%02uT%02u:%02u:%02u.%06lldZ ", y, m, d, s / 3600, (s / 60) % 60, s % 60, usec);
+      }
+      if (stamps & CAT_EPOCH) {
+        fprintf(out, "[%s%lld.%06lld]: ", us < 0 ? "-" : "", llabs(us) / 1000000, llabs(us) % 1000000);
+      }
+      if (stamps & CAT_SEQ) {
+        fprintf(out, "[%llu]: ", seq);
+      }
+    }
+    fwrite(payload, 1, len, out);
+    if (complete) {
+      putc('\n', out);
+    }
+    line_start = complete;
+  }
+
+  free(payload);
+  return r < 0;
+}
+
+/* Render archives and binary log files to stdout as text */
+int cat_main(int argc, char** argv) {
+  int stamps = 0, ret = 0, c = 0;
+
+  while ((c = getopt(argc, argv, "dequ")) != -1) {
+    switch (c) {
+      case 'd': stamps |= CAT_DATETIME; break;
+      case 'e': stamps |= CAT_EPOCH; break;
+      case 'q': stamps |= CAT_SEQ; break;
+      case 'u': stamps |= CAT_UTC; break;
+      default: stamps = -1; break;
+    }
+  }
+  if (optind >= argc || stamps < 0) {
+    eprint(0, "Usage: %s [-d] [-e] [-q] [-u] FILE...", argv[0]);
+    return 1;
+  }
+
+  for (; optind < argc && ret == 0; optind++) {
+    const char* in_filename = argv[optind];
+    char magic[4];
+    FILE* file = fopen(in_filename, "r");
+
+    if (!file) {
+      int err = errno;
+      eprint(err, "Failed to open file: %s", in_filename);
+      return 1;
+    }
+    if (fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, BINARY_MAGIC, sizeof(magic)) == 0) {
+      ret = binary_cat(file, stamps, stdout);
+      if (ret) {
+        eprint(0, "Corrupt binary log file: %s", in_filename);
+      }
+      fclose(file);
+    } else {
+      fclose(file);
+      ret = archive_cat(in_filename, stdout);
+    }
+  }
+  return ret;
+}
+
+/* A line queued by a merge source, ordered by time */
+struct merge_line {
+  long long us;
+  size_t offset;  /* of the text in the source's lines buffer */
+  size_t len;
+};
+
+/* A rotated set of log files read oldest first, as one stream of lines for merging */
+struct merge_source {
+  const char* filename;
+  int index;  /* of the file being read in the set, counting down to 0 for the active file */
+#ifdef HAVE_ZLIB
+  gzFile file;
+#else
+  FILE* file;
+#endif
+  char* buf;
+  size_t pos;
+  size_t len;
+  int done;
+
+  /* Lines read but not yet written, held back for up to the reorder window */
+  struct line_time_parser parser;
+  struct byte_buffer lines;
+  struct merge_line* queue;
+  size_t head;
+  size_t count;
+  size_t size;
+  long long last_us;  /* time of the last line read, also used for lines without a time */
+  long long high_us;  /* latest time read */
+};
+
+/* Open the next existing file of the set, compressed or not.  Returns 0 if one was opened. */
+int merge_open_next(struct merge_source* s) {
+  char name[MAX_FILENAME_LENGTH + 16];
+
+  for (; s->index >= 0; s->index--) {
+    if (s->index > 0) {
+      snprintf(name, sizeof(name), "%s.%d", s->filename, s->index);
+    } else {
+      snprintf(name, sizeof(name), "%s", s->filename);
+    }
+#ifdef HAVE_ZLIB
+    /* zlib reads uncompressed files unchanged */
+    s->file = gzopen(name, "rb");
+    if (!s->file) {
+      strcat(name, ".gz");
+      s->file = gzopen(name, "rb");
+    }
+    if (s->file) {
+      gzbuffer(s->file, MERGE_READ_SIZE);
+      s->index--;
+      return 0;
+    }
+#else
+    s->file = fopen(name, "r");
+    if (s->file) {
+      s->index--;
+      return 0;
+    }
+#endif
+  }
+  return 1;
+}
+
+/* Read more of the open file into the read buffer.  Returns the number of bytes read, or 0
+ * at the end of the file and -1 on errors, after closing it. */
+long merge_fill(struct merge_source* s) {
+#ifdef HAVE_ZLIB
+  long n = gzread(s->file, s->buf, MERGE_READ_SIZE);
+#else
+  long n = (long)fread(s->buf, 1, MERGE_READ_SIZE, s->file);
+  if (n == 0 && ferror(s->file)) {
+    n = -1;
+  }
+#endif
+  if (n > 0) {
+    s->pos = 0;
+    s->len = n;
+    return n;
+  }
+#ifdef HAVE_ZLIB
+  gzclose(s->file);
+#else
+  fclose(s->file);
+#endif
+  s->file = NULL;
+  return n < 0 ? -1 : 0;
+}
+
+/* Read the next line of the set into the queue, in time order.  Each file of the set ends
+ * its last line.  Returns 1 if a line was queued, 0 at the end of the set and -1 on errors. */
+int merge_read_line(struct merge_source* s) {
+  struct merge_line line = {0};
+  struct timespec ts = {0};
+  size_t i = 0;
+
+  line.offset = s->lines.len;
+  for (;;) {
+    char* nl = NULL;
+    size_t n = 0;
+
+    if (s->pos == s->len) {
+      long got = 0;
+      if (!s->file && merge_open_next(s) != 0) {
+        return 0;
+      }
+      got = merge_fill(s);
+      if (got < 0) {
+        return -1;
+      }
+      if (got == 0) {
+        if (s->lines.len > line.offset) {
+          if (buffer_append(&s->lines, "\n", 1) != 0) {
+            return -1;
+          }
+          break;
+        }
+        continue;
+      }
+    }
+    nl = memchr(s->buf + s->pos, '\n', s->len - s->pos);
+    n = nl ? (size_t)(nl - (s->buf + s->pos)) + 1 : s->len - s->pos;
+    if (buffer_append(&s->lines, s->buf + s->pos, n) != 0) {
+      return -1;
+    }
+    s->pos += n;
+    if (nl) {
+      break;
+    }
+  }
+  line.len = s->lines.len - line.offset;
+
+  /* Lines without a time keep the time of the line before, so continuation lines follow it */
+  if (parse_line_time(&s->parser, (const char*)s->lines.data + line.offset, line.len, &ts) == 0) {
+    s->last_us = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+  line.us = s->last_us;
+  if (line.us > s->high_us) {
+    s->high_us = line.us;
+  }
+
+  /* Insert after any queued lines that are not later */
+  if (s->head + s->count == s->size) {
+    if (s->head > 0) {
+      memmove(s->queue, s->queue + s->head, s->count * sizeof(*s->queue));
+      s->head = 0;
+    } else {
+      size_t size = s->size ? 2 * s->size : 256;
+      struct merge_line* queue = realloc(s->queue, size * sizeof(*queue));
+      if (!queue) {
+        return -1;
+      }
+      s->queue = queue;
+      s->size = size;
+    }
+  }
+  for (i = s->head + s->count; i > s->head && s->queue[i - 1].us > line.us; i--) {
+    s->queue[i] = s->queue[i - 1];
+  }
+  s->queue[i] = line;
+  s->count++;
+  return 1;
+}
+
+/* Read ahead until the earliest queued line is more than window microseconds behind the
+ * latest line read, so it can't be preceded by another line of the set.  Returns 1 if a line
+ * is ready, 0 at the end of the set and -1 on errors. */
+int merge_advance(struct merge_source* s, long long window) {
+  while (!s->done && (s->count == 0 || s->high_us - window < s->queue[s->head].us)) {
+    int r = merge_read_line(s);
+    if (r < 0) {
+      return -1;
+    }
+    s->done = (r == 0);
+  }
+  return s->count > 0;
+}
+
+/* Drop the earliest queued line, reclaiming the space of written lines */
+void merge_pop(struct merge_source* s) {
+  s->head++;
+  s->count--;
+  if (s->count == 0) {
+    s->head = 0;
+    s->lines.len = 0;
+  } else if (s->lines.len > MERGE_COMPACT_SIZE) {
+    size_t low = s->lines.len, i = 0;
+    for (i = s->head; i < s->head + s->count; i++) {
+      low = s->queue[i].offset < low ? s->queue[i].offset : low;
+    }
+    if (low > s->lines.len / 2) {
+      memmove(s->lines.data, s->lines.data + low, s->lines.len - low);
+      s->lines.len -= low;
+      for (i = s->head; i < s->head + s->count; i++) {
+        s->queue[i].offset -= low;
+      }
+    }
+  }
+}
+
+/* Order of sources in the merge heap: earliest line first, then the order given */
+int merge_before(struct merge_source* a, struct merge_source* b) {
+  long long ua = a->queue[a->head].us, ub = b->queue[b->head].us;
+  return ua < ub || (ua == ub && a < b);
+}
+
+void merge_sift_down(struct merge_source** heap, size_t n, size_t i) {
+  for (;;) {
+    size_t least = i, l = 2 * i + 1, r = 2 * i + 2;
+    struct merge_source* tmp = NULL;
+    if (l < n && merge_before(heap[l], heap[least])) {
+      least = l;
+    }
+    if (r < n && merge_before(heap[r], heap[least])) {
+      least = r;
+    }
+    if (least == i) {
+      return;
+    }
+    tmp = heap[i];
+    heap[i] = heap[least];
+    heap[least] = tmp;
+    i = least;
+  }
+}
+
+/* Merge rotated sets of log files into one stream ordered by the time at the start of each
+ * line, from a timestamp the producer wrote or a -d or -E stamp */
+int merge_main(int argc, char** argv) {
+  struct merge_source* sources = NULL;
+  struct merge_source** heap = NULL;
+  long long window = 0;
+  size_t count = 0, n = 0, i = 0;
+  int ret = 0, c = 0;
+
+  while ((c = getopt(argc, argv, "w:")) != -1) {
+    switch (c) {
+      case 'w':
+        window = (*optarg && strspn(optarg, "0123456789") == strlen(optarg)) ? atoll(optarg) : -1;
+        break;
+      default: window = -1; break;
+    }
+  }
+  if (optind >= argc || window < 0) {
+    eprint(0, "Usage: %s [-w USEC] LOG...", argv[0]);
+    return 1;
+  }
+
+  count = argc - optind;
+  sources = calloc(count, sizeof(*sources));
+  heap = calloc(count, sizeof(*heap));
+  if (!sources || !heap) {
+    eprint(0, "Failed to allocate merge sources%s", "");
+    ret = 1;
+    goto exit;
+  }
+  setvbuf(stdout, NULL, _IOFBF, MERGE_READ_SIZE);
+
+  /* Start each set at its oldest file, allowing for compressed files */
+  for (i = 0; i < count; i++) {
+    struct merge_source* s = &sources[i];
+    char name[MAX_FILENAME_LENGTH + 16];
+    struct stat sb = {0};
+
+    s->filename = argv[optind + i];
+    s->parser.hour = -1;
+    s->high_us = -(1LL << 62);
+    if (strlen(s->filename) > MAX_FILENAME_LENGTH) {
+      eprint(0, "Filename too long: %s", s->filename);
+      ret = 1;
+      goto exit;
+    }
+    for (s->index = 1;; s->index++) {
+      snprintf(name, sizeof(name), "%s.%d", s->filename, s->index);
+      if (stat(name, &sb) != 0) {
+        strcat(name, ".gz");
+        if (stat(name, &sb) != 0) {
+          break;
+        }
+      }
+    }
+    s->index--;
+    s->buf = malloc(MERGE_READ_SIZE);
+    if (!s->buf) {
+      eprint(0, "Failed to allocate merge sources%s", "");
+      ret = 1;
+      goto exit;
+    }
+    c = merge_advance(s, window);
+    if (c < 0) {
+      int err = errno;
+      eprint(err, "Failed to read log: %s", s->filename);
+      ret = 1;
+      goto exit;
+    }
+    if (c > 0) {
+      heap[n++] = s;
+    }
+  }
+
+  /* Write the earliest line, then advance its set */
+  for (i = n; i-- > 0;) {
+    merge_sift_down(heap, n, i);
+  }
+  while (n > 0) {
+    struct merge_source* s = heap[0];
+    struct merge_line* line = &s->queue[s->head];
+
+    if (fwrite(s->lines.data + line->offset, 1, line->len, stdout) != line->len) {
+      int err = errno;
+      eprint(err, "Failed to write merged output%s", "");
+      ret = 1;
+      goto exit;
+    }
+    merge_pop(s);
+    c = merge_advance(s, window);
+    if (c < 0) {
+      int err = errno;
+      eprint(err, "Failed to read log: %s", s->filename);
+      ret = 1;
+      goto exit;
+    }
+    if (c == 0) {
+      heap[0] = heap[--n];
+    }
+    merge_sift_down(heap, n, 0);
+  }
+  if (fflush(stdout) != 0) {
+    int err = errno;
+    eprint(err, "Failed to write merged output%s", "");
+    ret = 1;
+  }
+
+exit:
+  for (i = 0; sources && i < count; i++) {
+    if (sources[i].file) {
+#ifdef HAVE_ZLIB
+      gzclose(sources[i].file);
+#else
+      fclose(sources[i].file);
+#endif
+    }
+    free(sources[i].buf);
+    free(sources[i].lines.data);
+    free(sources[i].queue);
+  }
+  free(sources);
+  free(heap);
+  return ret;
+}
+
+/* Return the offset of the last newline in buf, or len if there is none.  Called through
+ * find_last_newline, which points at the best variant for the CPU. */
+size_t find_last_newline_base(const char* buf, size_t len) {
+  size_t i = len;
+
+#ifdef __SSE2__
+  const __m128i nl = _mm_set1_epi8('\n');
+
+  /* Check 64 bytes at a time from the end, only locating the exact byte once one is found */
+  for (; i >= 64; i -= 64) {
+    __m128i m0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i - 64)), nl);
+    __m128i m1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i - 48)), nl);
+    __m128i m2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i - 32)), nl);
+    __m128i m3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i - 16)), nl);
+    if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(m0, m1), _mm_or_si128(m2, m3)))) {
+      break;
+    }
+  }
+  for (; i >= 16; i -= 16) {
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i - 16)), nl));
+    if (mask) {
+      return i - 16 + (31 - __builtin_clz(mask));
+    }
+  }
+#endif
+
+  while (i > 0) {
+    if (buf[--i] == '\n') {
+      return i;
+    }
+  }
+  return len;
+}
+
+size_t (*find_last_newline)(const char* buf, size_t len) = find_last_newline_base;
+
+/* Kernel variants for the instruction set levels of x86-64 CPUs, compiled for each level with
+ * target attributes and chosen at startup by cpu_dispatch().  The baseline is SSE2 (part of
+ * x86-64).  Each variant checks 64 bytes per step and leaves what remains to the baseline,
+ * clearing the upper halves of the AVX registers first, as mixing them with SSE code stalls;
+ * AVX-512 needs no baseline, as its masked loads handle the remainder. */
+enum cpu_level {
+  CPU_BASELINE = 0,
+  CPU_AVX2,
+  CPU_AVX512,   /* AVX-512BW */
+  CPU_LEVELS
+};
+
+const char* const cpu_level_names[CPU_LEVELS] = {"baseline", "avx2", "avx512"};
+
+#ifdef HAVE_DISPATCH
+#define CONTROL_MASK_256(v) _mm256_or_si256(_mm256_andnot_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, tab), _mm256_cmpeq_epi8(v, nl)), \
+                                                                _mm256_cmpeq_epi8(_mm256_min_epu8(v, max_ctl), v)), \
+                                            _mm256_cmpeq_epi8(v, del))
+#define JSON_ESCAPE_MASK_256(v) _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, max_ctl), v), \
+                                                _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)))
+#define MASK_64(lo, hi) ((unsigned long long)(unsigned)_mm256_movemask_epi8(lo) | \
+                         (unsigned long long)(unsigned)_mm256_movemask_epi8(hi) << 32)
+
+__attribute__((target("avx2")))
+size_t find_control_avx2(const char* buf, size_t len) {
+  const __m256i max_ctl = _mm256_set1_epi8(0x1f);
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i nl = _mm256_set1_epi8('\n');
+  const __m256i del = _mm256_set1_epi8(0x7f);
+  size_t i = 0;
+
+  for (; i + 64 <= len; i += 64) {
+    __m256i v0 = _mm256_loadu_si256((const __m256i*)(buf + i));
+    __m256i v1 = _mm256_loadu_si256((const __m256i*)(buf + i + 32));
+    unsigned long long mask = MASK_64(CONTROL_MASK_256(v0), CONTROL_MASK_256(v1));
+    if (mask) {
+      return i + __builtin_ctzll(mask);
+    }
+  }
+  _mm256_zeroupper();
+  return i + find_control_base(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+size_t find_non_ascii_avx2(const char* buf, size_t len) {
+  size_t i = 0;
+
+  for (; i + 64 <= len; i += 64) {
+    __m256i v0 = _mm256_loadu_si256((const __m256i*)(buf + i));
+    __m256i v1 = _mm256_loadu_si256((const __m256i*)(buf + i + 32));
+    unsigned long long mask = MASK_64(v0, v1);
+    if (mask) {
+      return i + __builtin_ctzll(mask);
+    }
+  }
+  _mm256_zeroupper();
+  return i + find_non_ascii_base(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+size_t find_json_escape_avx2(const char* buf, size_t len) {
+  const __m256i max_ctl = _mm256_set1_epi8(0x1f);
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  size_t i = 0;
+
+  for (; i + 64 <= len; i += 64) {
+    __m256i v0 = _mm256_loadu_si256((const __m256i*)(buf + i));
+    __m256i v1 = _mm256_loadu_si256((const __m256i*)(buf + i + 32));
+    unsigned long long mask = MASK_64(JSON_ESCAPE_MASK_256(v0), JSON_ESCAPE_MASK_256(v1));
+    if (mask) {
+      return i + __builtin_ctzll(mask);
+    }
+  }
+  _mm256_zeroupper();
+  return i + find_json_escape_base(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+size_t find_last_newline_avx2(const char* buf, size_t len) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  size_t i = len, last = 0;
+
+  for (; i >= 64; i -= 64) {
+    __m256i v0 = _mm256_loadu_si256((const __m256i*)(buf + i - 64));
+    __m256i v1 = _mm256_loadu_si256((const __m256i*)(buf + i - 32));
+    unsigned long long mask = MASK_64(_mm256_cmpeq_epi8(v0, nl), _mm256_cmpeq_epi8(v1, nl));
+    if (mask) {
+      return i - 64 + (63 - __builtin_clzll(mask));
+    }
+  }
+  _mm256_zeroupper();
+  last = find_last_newline_base(buf, i);
+  return last == i ? len : last;
+}
+
+#undef CONTROL_MASK_256
+#undef JSON_ESCAPE_MASK_256
+#undef MASK_64
+
+/* Bytes from i to len, at most 64, as a load mask */
+#define TAIL_MASK(i, len) ((len) - (i) >= 64 ? ~0ULL : (1ULL << ((len) - (i))) - 1)
+
+__attribute__((target("avx512f,avx512bw")))
+size_t find_control_avx512(const char* buf, size_t len) {
+  const __m512i max_ctl = _mm512_set1_epi8(0x1f);
+  const __m512i tab = _mm512_set1_epi8('\t');
+  const __m512i nl = _mm512_set1_epi8('\n');
+  const __m512i del = _mm512_set1_epi8(0x7f);
+  size_t i = 0;
+
+  for (; i < len; i += 64) {
+    __mmask64 load = TAIL_MASK(i, len);
+    __m512i v = _mm512_maskz_loadu_epi8(load, buf + i);
+    __mmask64 mask = ((_mm512_cmple_epu8_mask(v, max_ctl) & ~(_mm512_cmpeq_epi8_mask(v, tab) | _mm512_cmpeq_epi8_mask(v, nl))) |
+                      _mm512_cmpeq_epi8_mask(v, del)) & load;
+    if (mask) {
+      return i + __builtin_ctzll(mask);
+    }
+  }
+  return len;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+size_t find_non_ascii_avx512(const char* buf, size_t len) {
+  size_t i = 0;
+
+  for (; i < len; i += 64) {
+    __mmask64 mask = _mm512_movepi8_mask(_mm512_maskz_loadu_epi8(TAIL_MASK(i, len), buf + i));
+    if (mask) {
+      return i + __builtin_ctzll(mask);
+    }
+  }
+  return len;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+size_t find_json_escape_avx512(const char* buf, size_t len) {
+  const __m512i max_ctl = _mm512_set1_epi8(0x1f);
+  const __m512i quote = _mm512_set1_epi8('"');
+  const __m512i backslash = _mm512_set1_epi8('\\');
+  size_t i = 0;
+
+  for (; i < len; i += 64) {
+    __mmask64 load = TAIL_MASK(i, len);
+    __m512i v = _mm512_maskz_loadu_epi8(load, buf + i);
+    __mmask64 mask = (_mm512_cmple_epu8_mask(v, max_ctl) | _mm512_cmpeq_epi8_mask(v, quote) |
+                      _mm512_cmpeq_epi8_mask(v, backslash)) & load;
+    if (mask) {
+      return i + __builtin_ctzll(mask);
+    }
+  }
+  return len;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+size_t find_last_newline_avx512(const char* buf, size_t len) {
+  const __m512i nl = _mm512_set1_epi8('\n');
+  size_t i = len;
+
+  while (i > 0) {
+    size_t n = i >= 64 ? 64 : i;
+    __mmask64 load = TAIL_MASK(0, n);
+    __mmask64 mask = _mm512_mask_cmpeq_epi8_mask(load, _mm512_maskz_loadu_epi8(load, buf + i - n), nl);
+    if (mask) {
+      return i - n + (63 - __builtin_clzll(mask));
+    }
+    i -= n;
+  }
+  return len;
+}
+
+#undef TAIL_MASK
+#endif
+
+/* The best level the CPU supports */
+enum cpu_level cpu_detect(void) {
+#ifdef HAVE_DISPATCH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+    return CPU_AVX512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return CPU_AVX2;
+  }
+#endif
+  return CPU_BASELINE;
+}
+
+/* The level used unless -C gives one, for a CPU supporting up to supported.  AVX-512 is only
+ * used when asked for: in bench/micro it was behind AVX2 on the reverse newline scan (about 6
+ * vs 8 GB/s at 64 KiB) and UTF-8 validation (about 25 vs 35 GB/s), and ahead only on the
+ * control byte scans, while it may also lower the clock of the core on some CPUs. */
+enum cpu_level cpu_default(enum cpu_level supported) {
+  return supported < CPU_AVX2 ? supported : CPU_AVX2;
+}
+
+/* Point the kernels at the variants for level, which the CPU must support */
+void cpu_dispatch(enum cpu_level level) {
+  find_control = find_control_base;
+  find_non_ascii = find_non_ascii_base;
+  find_json_escape = find_json_escape_base;
+  find_last_newline = find_last_newline_base;
+#ifdef HAVE_DISPATCH
+  if (level == CPU_AVX2) {
+    find_control = find_control_avx2;
+    find_non_ascii = find_non_ascii_avx2;
+    find_json_escape = find_json_escape_avx2;
+    find_last_newline = find_last_newline_avx2;
+  } else if (level == CPU_AVX512) {
+    find_control = find_control_avx512;
+    find_non_ascii = find_non_ascii_avx512;
+    find_json_escape = find_json_escape_avx512;
+    find_last_newline = find_last_newline_avx512;
+  }
+#else
+  (void)level;
+#endif
+}
+
+/* Write the lines of the set newest first, reading each file backward from its end in blocks,
+ * stopping once *lines, counting the lines written by earlier sets too, reaches max_lines (if
+ * not 0) or at the first line stamped before since_us (if set).  Returns 0 on success. */
+int tac_set(const char* filename, unsigned long long max_lines, unsigned long long* lines, int has_since,
+            long long since_us, FILE* out) {
+  struct line_time_parser parser = {-1, 0};
+  char name[MAX_FILENAME_LENGTH + 16];
+  char* buf = NULL;
+  size_t size = 0;
+  int index = 0, ret = 0, done = 0;
+
+  for (index = 0; !done; index++) {
+    struct stat sb = {0};
+    off_t off = 0;
+    size_t start = 0, end = 0;
+    int fd = -1, last = 1;
+
+    if (index > 0) {
+      snprintf(name, sizeof(name), "%s.%d", filename, index);
+    } else {
+      snprintf(name, sizeof(name), "%s", filename);
+    }
+    fd = open(name, O_RDONLY);
+    if (fd < 0) {
+      int err = errno;
+      if (err != ENOENT) {
+        eprint(err, "Failed to open log: %s", name);
+        ret = 1;
+      }
+      if (index == 0 && err == ENOENT) {
+        continue;
+      }
+      break;
+    }
+    if (fstat(fd, &sb) != 0) {
+      int err = errno;
+      eprint(err, "Failed to read log: %s", name);
+      close(fd);
+      ret = 1;
+      break;
+    }
+
+    /* Buffered text is kept at the end of buf, between start and end, with each block read
+     * from further back in the file placed in front of it */
+    off = sb.st_size;
+    start = end = size;
+    while (!done && (off > 0 || end > start)) {
+      size_t scan = end > start ? end - start - 1 : 0;  /* before the newline ending the line */
+      size_t nl = find_last_newline(buf + start, scan), line_start = 0;
+      struct timespec ts = {0};
+
+      if (nl == scan && off > 0) {
+        size_t n = off < TAC_BLOCK_SIZE ? (size_t)off : TAC_BLOCK_SIZE;
+        ssize_t got = 0;
+
+        if (start < n) {
+          size_t keep = end - start;
+          char* grown = NULL;
+          if (keep + n > size) {
+            size_t grown_size = size ? size : TAC_BLOCK_SIZE;
+            while (grown_size < keep + n) {
+              grown_size *= 2;
+            }
+            grown = malloc(grown_size);
+            if (!grown) {
+              eprint(0, "Failed to allocate buffer%s", "");
+              ret = 1;
+              break;
+            }
+            memcpy(grown + grown_size - keep, buf + start, keep);
+            free(buf);
+            buf = grown;
+            size = grown_size;
+          } else {
+            memmove(buf + size - keep, buf + start, keep);
+          }
+          start = size - keep;
+          end = size;
+        }
+        got = pread(fd, buf + start - n, n, off - n);
+        if (got != (ssize_t)n) {
+          int err = got < 0 ? errno : 0;
+          eprint(err, "Failed to read log: %s", name);
+          ret = 1;
+          break;
+        }
+        start -= n;
+        off -= n;
+        continue;
+      }
+
+      /* Write the last line of what's buffered, ending it if it is the unterminated end of
+       * the file */
+      line_start = (nl == scan) ? start : start + nl + 1;
+      if (has_since && parse_line_time(&parser, buf + line_start, end - line_start, &ts) == 0 &&
+          (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 < since_us) {
+        done = 1;
+        break;
+      }
+      if (fwrite(buf + line_start, 1, end - line_start, out) != end - line_start ||
+          (last && buf[end - 1] != '\n' && fputc('\n', out) == EOF)) {
+        int err = errno;
+        eprint(err, "Failed to write output%s", "");
+        ret = 1;
+        break;
+      }
+      last = 0;
+      end = line_start;
+      if (max_lines && ++*lines == max_lines) {
+        done = 1;
+      }
+    }
+    close(fd);
+    if (ret != 0) {
+      break;
+    }
+  }
+  free(buf);
+  return ret;
+}
+
+/* Write rotated sets of log files newest line first */
+int tac_main(int argc, char** argv) {
+  struct line_time_parser parser = {-1, 0};
+  unsigned long long max_lines = 0, lines = 0;
+  long long since_us = 0;
+  int has_since = 0, ret = 0, c = 0, bad = 0;
+
+  while ((c = getopt(argc, argv, "n:s:")) != -1) {
+    switch (c) {
+      case 'n':
+        bad |= !*optarg || strspn(optarg, "0123456789") != strlen(optarg);
+        max_lines = strtoull(optarg, NULL, 10);
+        break;
+
+      case 's': {
+        struct timespec ts = {0};
+        bad |= parse_line_time(&parser, optarg, strlen(optarg), &ts) != 0;
+        since_us = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+        has_since = 1;
+        break;
+      }
+
+      default: bad = 1; break;
+    }
+  }
+  if (optind >= argc || bad) {
+    eprint(0, "Usage: %s [-n LINES] [-s TIME] LOG...", argv[0]);
+    return 1;
+  }
+  setvbuf(stdout, NULL, _IOFBF, TAC_BLOCK_SIZE);
+
+  /* The sets are written one after another, with -n counting the lines of all of them */
+  for (; optind < argc && ret == 0 && (!max_lines || lines < max_lines); optind++) {
+    if (strlen(argv[optind]) > MAX_FILENAME_LENGTH) {
+      eprint(0, "Filename too long: %s", argv[optind]);
+      return 1;
+    }
+    ret = tac_set(argv[optind], max_lines, &lines, has_since, since_us, stdout);
+  }
+  if (fflush(stdout) != 0) {
+    int err = errno;
+    eprint(err, "Failed to write output%s", "");
+    ret = 1;
+  }
+  return ret;
+}
+
+/* Stages of the main loop that hardware counters are charged to */
+enum perf_stage {
+  PERF_READ = 0,  /* reading input, and anything else between blocks */
+  PERF_SCAN,      /* checking and repairing the block (-s, -u) */
+  PERF_WRITE,     /* stamping, formatting and writing lines */
+  PERF_FLUSH,     /* flushing (and with -y, syncing) the log file */
+  PERF_ROTATE,    /* rotating log files */
+  PERF_STAGES
+};
+
+const char* const perf_stage_names[PERF_STAGES] = {"read", "scan", "write", "flush", "rotate"};
+
+enum perf_counter {
+  PERF_CYCLES = 0,
+  PERF_INSTRUCTIONS,
+  PERF_CACHE_MISSES,
+  PERF_BRANCH_MISSES,
+  PERF_COUNTERS
+};
+
+/* Hardware counters of the main thread, counted as one perf_event_open() group so all of
+ * them are read with a single read() at each stage boundary */
+struct perf_counters {
+  int fds[PERF_COUNTERS];  /* fds[0] leads the group, -1 if not counting */
+  unsigned long long last[PERF_COUNTERS];
+  unsigned long long totals[PERF_STAGES][PERF_COUNTERS];
+};
+
+void perf_stop(struct perf_counters* p) {
+  int i = 0;
+
+  for (i = PERF_COUNTERS - 1; i >= 0; i--) {
+    if (p->fds[i] >= 0) {
+      close(p->fds[i]);
+      p->fds[i] = -1;
+    }
+  }
+}
+
+/* Open the counters for the calling thread.  Returns 0 on success. */
+int perf_start(struct perf_counters* p) {
+  int i = 0;
+
+  for (i = 0; i < PERF_COUNTERS; i++) {
+    p->fds[i] = -1;
+  }
+#ifdef __linux__
+  {
+    static const unsigned long long configs[PERF_COUNTERS] = {
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+    };
+    int exclude_kernel = 0;
+
+    for (i = 0; i < PERF_COUNTERS; i++) {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = configs[i];
+      attr.read_format = PERF_FORMAT_GROUP;
+      attr.disabled = (i == 0);
+      attr.exclude_kernel = exclude_kernel;
+      attr.exclude_hv = 1;
+      p->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i ? p->fds[0] : -1, 0);
+
+      /* Without permission to count in the kernel, only count user space */
+      if (p->fds[i] < 0 && i == 0 && !exclude_kernel && (errno == EACCES || errno == EPERM)) {
+        exclude_kernel = 1;
+        i--;
+        continue;
+      }
+      if (p->fds[i] < 0) {
+        int err = errno;
+        if (err == ENOENT || err == EOPNOTSUPP) {
+          wprint(0, "Hardware performance counters are not available on this machine%s", "");
+        } else {
+          wprint(err, "Failed to open hardware performance counters%s", "");
+        }
+        perf_stop(p);
+        return 1;
+      }
+    }
+    ioctl(p->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return 0;
+  }
+#else
+  wprint(0, "Hardware performance counters are only supported on Linux%s", "");
+  return 1;
+#endif
+}
+
+/* Charge the counts since the last mark to stage */
+void perf_mark(struct perf_counters* p, enum perf_stage stage) {
+  unsigned long long values[1 + PERF_COUNTERS];
+  int i = 0;
+
+  if (p->fds[0] < 0 || read(p->fds[0], values, sizeof(values)) != sizeof(values)) {
+    return;
+  }
+  for (i = 0; i < PERF_COUNTERS; i++) {
+    p->totals[stage][i] += values[1 + i] - p->last[i];
+    p->last[i] = values[1 + i];
+  }
+}
+
+/* Print the counts of each stage per MB read and per line */
+void perf_report(const struct perf_counters* p, unsigned long long bytes, unsigned long long lines, FILE* out) {
+  double mb = bytes / 1048576.0;
+  int i = 0;
+
+  fprintf(out, "%-8s %14s %14s %14s %14s  (per MB / per line)\n", "stage", "cycles", "instructions",
+          "cache-misses", "branch-misses");
+  for (i = 0; i < PERF_STAGES; i++) {
+    const unsigned long long* t = p->totals[i];
+    fprintf(out, "%-8s %14.0f %14.0f %14.1f %14.1f\n", perf_stage_names[i], mb ? t[PERF_CYCLES] / mb : 0,
+            mb ? t[PERF_INSTRUCTIONS] / mb : 0, mb ? t[PERF_CACHE_MISSES] / mb : 0,
+            mb ? t[PERF_BRANCH_MISSES] / mb : 0);
+    fprintf(out, "%-8s %14.1f %14.1f %14.3f %14.3f\n", "", lines ? (double)t[PERF_CYCLES] / lines : 0,
+            lines ? (double)t[PERF_INSTRUCTIONS] / lines : 0, lines ? (double)t[PERF_CACHE_MISSES] / lines : 0,
+            lines ? (double)t[PERF_BRANCH_MISSES] / lines : 0);
+  }
+}
+
+/* Set by signal handlers and acted on by the main loop, as read() returns EINTR */
+volatile sig_atomic_t metrics_dump_requested = 0;
+volatile sig_atomic_t metrics_save_requested = 0;
+
+void metrics_signal(int sig) {
+  if (sig == SIGUSR1) {
+    metrics_dump_requested = 1;
+  } else {
+    metrics_save_requested = 1;
+  }
+}
+
+/* Log-linear histogram of nanosecond durations in the style of HdrHistogram: values below
+ * 2^HISTOGRAM_SUB_BITS are exact, and each power of two above is split into that many
+ * buckets, for a relative error of about 3% over the whole range */
+struct histogram {
+  unsigned long long counts[HISTOGRAM_BUCKETS];
+  unsigned long long count;
+  long long sum;
+  long long max;
+};
+
+int histogram_index(unsigned long long v) {
+  int shift = 0;
+  if (v < (1 << HISTOGRAM_SUB_BITS)) {
+    return (int)v;
+  }
+  shift = 63 - __builtin_clzll(v) - HISTOGRAM_SUB_BITS;
+  return ((shift + 1) << HISTOGRAM_SUB_BITS) + (int)(v >> shift) - (1 << HISTOGRAM_SUB_BITS);
+}
+
+/* Highest value counted in bucket i */
+unsigned long long histogram_value(int i) {
+  int shift = (i >> HISTOGRAM_SUB_BITS) - 1;
+  if (shift < 0) {
+    return i;
+  }
+  return (((unsigned long long)(i & ((1 << HISTOGRAM_SUB_BITS) - 1)) + (1 << HISTOGRAM_SUB_BITS) + 1) << shift) - 1;
+}
+
+void histogram_record(struct histogram* h, long long ns) {
+  if (ns < 0) {
+    ns = 0;
+  }
+  h->counts[histogram_index(ns)]++;
+  h->count++;
+  h->sum += ns;
+  if (ns > h->max) {
+    h->max = ns;
+  }
+}
+
+/* Value at quantile q, no more than the largest recorded */
+long long histogram_quantile(const struct histogram* h, double q) {
+  unsigned long long rank = (unsigned long long)(q * h->count + 0.5), seen = 0;
+  int i = 0;
+
+  if (rank == 0) {
+    rank = 1;
+  }
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      return (long long)histogram_value(i) < h->max ? (long long)histogram_value(i) : h->max;
+    }
+  }
+  return h->max;
+}
+
+/* Counters and gauges of the logging pipeline, updated by the main thread once per input
+ * block or rotation rather than per line */
+struct metrics {
+  time_t start;
+  unsigned long long reads;
+  unsigned long long read_bytes;
+  unsigned long long written_bytes;
+  unsigned long long lines;
+  unsigned long long flushes;
+  unsigned long long rotations;
+  unsigned long long write_errors;
+  unsigned long long field_drops;
+  unsigned long long archive_drops;
+  long long read_ns;          /* blocked in read() */
+  long long write_ns;         /* writing blocks out, including formatting and flushing */
+  long long rotation_ns;
+  long long rotation_max_ns;
+  size_t buffered;            /* bytes filled by the last read */
+  long log_lines;             /* lines in the current log file */
+  off_t out_pos;              /* position in the current log file last counted */
+
+  /* Latencies, once per input block or rotation */
+  struct histogram write_latency;  /* from read() returning to the block being written */
+  struct histogram sync_latency;   /* from read() returning to the block being synced (-y) */
+  struct histogram flush;
+  struct histogram rotation;
+
+  const struct perf_counters* perf;  /* with -P */
+};
+
+/* Count what was written to file since the last call */
+void metrics_output(struct metrics* m, FILE* file) {
+  off_t pos = ftello(file);
+  if (pos > m->out_pos) {
+    m->written_bytes += pos - m->out_pos;
+  }
+  m->out_pos = pos;
+}
+
+void metric_print(FILE* out, const char* name, const char* type, const char* help, double value) {
+  fprintf(out, "# HELP lumberjack_%s %s\n# TYPE lumberjack_%s %s\n", name, help, name, type);
+  fprintf(out, value == (double)(long long)value ? "lumberjack_%s %.0f\n" : "lumberjack_%s %.9g\n", name, value);
+}
+
+/* Print quantiles of a histogram as a Prometheus summary in seconds */
+void metric_print_histogram(FILE* out, const char* name, const char* help, const struct histogram* h) {
+  static const char* quantiles[] = {"0.5", "0.9", "0.99", "0.999", "1"};
+  size_t i = 0;
+
+  fprintf(out, "# HELP lumberjack_%s %s\n# TYPE lumberjack_%s summary\n", name, help, name);
+  for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+    fprintf(out, "lumberjack_%s{quantile=\"%s\"} %.9g\n", name, quantiles[i],
+            h->count ? histogram_quantile(h, atof(quantiles[i])) / 1e9 : 0.0);
+  }
+  fprintf(out, "lumberjack_%s_sum %.9g\nlumberjack_%s_count %llu\n", name, h->sum / 1e9, name, h->count);
+}
+
+/* Print a hardware counter of each stage */
+void metric_print_perf(FILE* out, const char* name, const char* help, const struct perf_counters* p, enum perf_counter counter) {
+  int i = 0;
+
+  fprintf(out, "# HELP lumberjack_%s %s\n# TYPE lumberjack_%s counter\n", name, help, name);
+  for (i = 0; i < PERF_STAGES; i++) {
+    fprintf(out, "lumberjack_%s{stage=\"%s\"} %llu\n", name, perf_stage_names[i], p->totals[i][counter]);
+  }
+}
+
+/* Write the metrics in the Prometheus text format.  Returns 0 on success. */
+int metrics_write(const struct metrics* m, FILE* out) {
+  metric_print(out, "start_time_seconds", "gauge", "Time lumberjack started, in seconds since the epoch.", m->start);
+  metric_print(out, "reads_total", "counter", "Reads from the input.", m->reads);
+  metric_print(out, "read_bytes_total", "counter", "Bytes read from the input.", m->read_bytes);
+  metric_print(out, "read_blocked_seconds_total", "counter", "Time blocked reading the input.", m->read_ns / 1e9);
+  metric_print(out, "written_bytes_total", "counter", "Bytes written to log files.", m->written_bytes);
+  metric_print(out, "write_seconds_total", "counter", "Time writing input blocks to the log, including formatting.", m->write_ns / 1e9);
+  metric_print(out, "lines_total", "counter", "Lines logged.", m->lines);
+  metric_print(out, "flushes_total", "counter", "Flushes of the log file.", m->flushes);
+  metric_print(out, "write_errors_total", "counter", "Failed writes to the log, each followed by a rotation.", m->write_errors);
+  metric_print(out, "rotations_total", "counter", "Log file rotations.", m->rotations);
+  metric_print(out, "rotation_seconds_total", "counter", "Time spent rotating log files.", m->rotation_ns / 1e9);
+  metric_print(out, "rotation_max_seconds", "gauge", "Longest log file rotation.", m->rotation_max_ns / 1e9);
+  metric_print(out, "field_dropped_lines_total", "counter", "Lines not field extracted because extraction fell behind.", m->field_drops);
+  metric_print(out, "archive_dropped_files_total", "counter", "Retired log files not archived because archiving fell behind.", m->archive_drops);
+  metric_print(out, "input_buffer_bytes", "gauge", "Bytes of the input buffer filled by the last read.", m->buffered);
+  metric_print(out, "input_buffer_size_bytes", "gauge", "Size of the input buffer.", INPUT_BUFFER_SIZE);
+  metric_print(out, "log_lines", "gauge", "Lines in the current log file.", m->log_lines);
+  metric_print_histogram(out, "write_latency_seconds", "Time from reading input to writing it to the log.", &m->write_latency);
+  metric_print_histogram(out, "sync_latency_seconds", "Time from reading input to syncing it to disk (-y).", &m->sync_latency);
+  metric_print_histogram(out, "flush_seconds", "Time flushing the log once per input read.", &m->flush);
+  metric_print_histogram(out, "rotation_pause_seconds", "Time output was paused rotating log files.", &m->rotation);
+  if (m->perf) {
+    metric_print_perf(out, "cpu_cycles_total", "CPU cycles of the main loop by stage (-P).", m->perf, PERF_CYCLES);
+    metric_print_perf(out, "cpu_instructions_total", "Instructions of the main loop by stage (-P).", m->perf, PERF_INSTRUCTIONS);
+    metric_print_perf(out, "cpu_cache_misses_total", "Cache misses of the main loop by stage (-P).", m->perf, PERF_CACHE_MISSES);
+    metric_print_perf(out, "cpu_branch_misses_total", "Branch mispredicts of the main loop by stage (-P).", m->perf, PERF_BRANCH_MISSES);
+  }
+  return ferror(out) ? 1 : 0;
+}
+
+/* Replace filename with the current metrics, for the Prometheus node exporter textfile
+ * collector.  Returns 0 on success. */
+int metrics_save(const struct metrics* m, const char* filename) {
+  char tmp_name[MAX_FILENAME_LENGTH + 8];
+  FILE* file = NULL;
+
+  snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", filename);
+  file = fopen(tmp_name, "w");
+  if (!file) {
+    return 1;
+  }
+  if (metrics_write(m, file) != 0) {
+    fclose(file);
+    unlink(tmp_name);
+    return 1;
+  }
+  if (fclose(file) != 0 || rename(tmp_name, filename) != 0) {
+    unlink(tmp_name);
+    return 1;
+  }
+  return 0;
+}
+
+/* Rotate the log files, queueing the retired log file to be archived if ar is not NULL */
+int retire_log(FILE** file, const char* filename, int max_files, struct archiver* ar) {
+  struct stat sb = {0};
+  int fd = -1;
+
+  /* Open the current log file first, so it can be read wherever rotation moves it */
+  if (ar && max_files > 1) {
+    fd = open(filename, O_RDONLY);
+  }
+  if (rotate_log(file, filename, "", max_files) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 1;
+  }
+  if (fd >= 0) {
+    if (fstat(fd, &sb) == 0 && sb.st_size > 0) {
+      archive_retired(ar, fd);
+    } else {
+      close(fd);
+    }
+  }
+  return 0;
+}
+
+/* A trace of a live stream, for replaying it into lumberjack at its original pace.  Layout
+ * (integers are varints): RECORD_MAGIC, flags (1 if line text is included), then for each line
+ * the microseconds since the previous line arrived, its length times 2 plus 1 if it ended with
+ * a newline, and with text, the line with its letters and digits masked. */
+
+/* Mask the letters, digits and non-ASCII bytes of a line, keeping its shape: length, spacing,
+ * punctuation and control bytes */
+void record_anonymize(char* buf, size_t len) {
+  size_t i = 0;
+
+  for (i = 0; i < len; i++) {
+    unsigned char c = buf[i];
+    if (c >= 'a' && c <= 'z') {
+      buf[i] = 'x';
+    } else if (c >= 'A' && c <= 'Z') {
+      buf[i] = 'X';
+    } else if (c >= '0' && c <= '9') {
+      buf[i] = '0';
+    } else if (c >= 0x80) {
+      buf[i] = '?';
+    }
+  }
+}
+
+/* Write all of buf to fd.  Returns 0 on success. */
+int write_all(int fd, const char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Append one line to the trace, masking text in place if it is not NULL.  Returns 0 on
+ * success. */
+int record_line(FILE* out, unsigned long long delta_us, size_t len, int newline, char* text) {
+  unsigned char header[20];
+  size_t n = 0;
+
+  n = put_varint(header, delta_us);
+  n += put_varint(header + n, (unsigned long long)len * 2 + (newline ? 1 : 0));
+  if (fwrite(header, 1, n, out) != n) {
+    return 1;
+  }
+  if (text) {
+    record_anonymize(text, len);
+    if (fwrite(text, 1, len, out) != len) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Copy stdin to stdout, recording when each line arrived in a trace file */
+int record_main(int argc, char** argv) {
+  FILE* out = NULL;
+  char* buf = NULL;
+  struct byte_buffer line = {0};
+  unsigned long long line_len = 0;
+  long long last_us = 0, now_us = 0;
+  int do_text = 0, ret = 0, c = 0, bad = 0;
+  unsigned char flags = 0;
+
+  while ((c = getopt(argc, argv, "t")) != -1) {
+    switch (c) {
+      case 't': do_text = 1; break;
+      default: bad = 1; break;
+    }
+  }
+  if (optind != argc - 1 || bad) {
+    eprint(0, "Usage: %s [-t] TRACE", argv[0]);
+    return 1;
+  }
+
+  buf = malloc(INPUT_BUFFER_SIZE);
+  if (!buf) {
+    eprint(0, "Failed to allocate input buffer%s", "");
+    return 1;
+  }
+  out = fopen(argv[optind], "wb");
+  if (!out) {
+    int err = errno;
+    eprint(err, "Failed to open trace: %s", argv[optind]);
+    ret = 1;
+    goto exit;
+  }
+  flags = do_text ? 1 : 0;
+  if (fwrite(RECORD_MAGIC, 1, 4, out) != 4 || fwrite(&flags, 1, 1, out) != 1) {
+    goto write_failed;
+  }
+
+  /* Lines arriving in one read arrive together, and a line split across reads arrives with
+   * its end */
+  last_us = monotonic_ns() / 1000;
+  for (;;) {
+    ssize_t n = read(STDIN_FILENO, buf, INPUT_BUFFER_SIZE);
+    const char* p = buf;
+    const char* end = NULL;
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      int err = errno;
+      eprint(err, "Failed to read input%s", "");
+      ret = 1;
+      break;
+    }
+    if (n == 0) {
+      break;
+    }
+    now_us = monotonic_ns() / 1000;
+    if (write_all(STDOUT_FILENO, buf, n) != 0) {
+      int err = errno;
+      eprint(err, "Failed to write output%s", "");
+      ret = 1;
+      break;
+    }
+
+    end = buf + n;
+    while (p < end) {
+      const char* nl = memchr(p, '\n', end - p);
+      const char* chunk_end = nl ? nl : end;
+
+      line_len += chunk_end - p;
+      if (do_text && buffer_append(&line, p, chunk_end - p) != 0) {
+        eprint(0, "Failed to allocate line buffer%s", "");
+        ret = 1;
+        goto exit;
+      }
+      if (!nl) {
+        break;
+      }
+      if (record_line(out, now_us - last_us, line_len, 1, do_text ? (char*)line.data : NULL) != 0) {
+        goto write_failed;
+      }
+      last_us = now_us;
+      line_len = 0;
+      line.len = 0;
+      p = nl + 1;
+    }
+  }
+  if (line_len > 0 && record_line(out, now_us - last_us, line_len, 0, do_text ? (char*)line.data : NULL) != 0) {
+    goto write_failed;
+  }
+  goto exit;
+
+write_failed: {
+    int err = errno;
+    eprint(err, "Failed to write trace: %s", argv[optind]);
+    ret = 1;
+  }
+
+exit:
+  if (out && fclose(out) != 0 && ret == 0) {
+    int err = errno;
+    eprint(err, "Failed to write trace: %s", argv[optind]);
+    ret = 1;
+  }
+  free(line.data);
+  free(buf);
+  return ret;
+}
+
+/* Output of a replay, with how long the producer blocked handing it over */
+struct replayer {
+  char* buf;
+  size_t len;
+  unsigned long long lines;
+  unsigned long long bytes;
+  unsigned long long writes;
+  unsigned long long stalls;     /* writes blocked for REPLAY_STALL_NS or more */
+  long long blocked_ns;
+  long long max_lag_ns;          /* furthest behind the recorded schedule */
+  struct histogram write_latency;
+};
+
+/* Write out the buffered lines, timing each write(), which blocks while a pipe to the
+ * consumer is full.  Returns 0 on success. */
+int replay_flush(struct replayer* r) {
+  const char* p = r->buf;
+
+  while (r->len > 0) {
+    long long start = monotonic_ns(), ns = 0;
+    ssize_t n = write(STDOUT_FILENO, p, r->len);
+
+    ns = monotonic_ns() - start;
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 1;
+    }
+    r->writes++;
+    r->blocked_ns += ns;
+    r->stalls += ns >= REPLAY_STALL_NS;
+    histogram_record(&r->write_latency, ns);
+    r->bytes += n;
+    p += n;
+    r->len -= n;
+  }
+  return 0;
+}
+
+/* Write a trace to stdout at its recorded pace, speed times faster, or with speed 0 as fast
+ * as possible */
+int replay_main(int argc, char** argv) {
+  static const char filler[] = "lorem ipsum dolor sit amet consectetur adipiscing elit sed do eiusmod tempor "
+                               "incididunt ut labore et dolore magna aliqua ";
+  struct replayer* r = NULL;
+  FILE* in = NULL;
+  char magic[4];
+  char* end = NULL;
+  double speed = 1;
+  size_t fill = 0;
+  long long start_ns = 0, recorded_us = 0;
+  int flags = 0, ret = 0, c = 0, bad = 0;
+
+  while ((c = getopt(argc, argv, "s:")) != -1) {
+    switch (c) {
+      case 's':
+        speed = strtod(optarg, &end);
+        bad |= end == optarg || *end || speed < 0;
+        break;
+      default: bad = 1; break;
+    }
+  }
+  if (optind != argc - 1 || bad) {
+    eprint(0, "Usage: %s [-s SPEED] TRACE", argv[0]);
+    return 1;
+  }
+
+  r = calloc(1, sizeof(*r));
+  if (r) {
+    r->buf = malloc(INPUT_BUFFER_SIZE);
+  }
+  if (!r || !r->buf) {
+    eprint(0, "Failed to allocate output buffer%s", "");
+    ret = 1;
+    goto exit;
+  }
+  in = fopen(argv[optind], "rb");
+  if (!in) {
+    int err = errno;
+    eprint(err, "Failed to open trace: %s", argv[optind]);
+    ret = 1;
+    goto exit;
+  }
+  if (fread(magic, 1, 4, in) != 4 || memcmp(magic, RECORD_MAGIC, 4) != 0 || (flags = fgetc(in)) == EOF) {
+    eprint(0, "Not a trace: %s", argv[optind]);
+    ret = 1;
+    goto exit;
+  }
+
+  /* A consumer that exits is reported as a write error rather than killing the replay */
+  signal(SIGPIPE, SIG_IGN);
+  start_ns = monotonic_ns();
+  for (;;) {
+    unsigned long long delta_us = 0, len = 0;
+    int newline = 0;
+
+    if (fread_varint(in, &delta_us) != 0) {
+      if (!feof(in) || ferror(in)) {
+        eprint(0, "Truncated trace: %s", argv[optind]);
+        ret = 1;
+      }
+      break;
+    }
+    if (fread_varint(in, &len) != 0) {
+      eprint(0, "Truncated trace: %s", argv[optind]);
+      ret = 1;
+      break;
+    }
+    newline = len & 1;
+    len >>= 1;
+    recorded_us += delta_us;
+
+    /* Hand over everything that arrived before this line, then wait until it is due */
+    if (delta_us > 0 && speed > 0) {
+      long long due_ns = start_ns + (long long)(recorded_us * 1000 / speed), now_ns = 0;
+
+      if (replay_flush(r) != 0) {
+        goto write_failed;
+      }
+      now_ns = monotonic_ns();
+      if (now_ns < due_ns) {
+        struct timespec due = {due_ns / 1000000000, due_ns % 1000000000};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR) {
+        }
+      } else if (now_ns - due_ns > r->max_lag_ns) {
+        r->max_lag_ns = now_ns - due_ns;
+      }
+    }
+
+    /* The recorded text, or filler of the same length */
+    while (len > 0) {
+      size_t n = INPUT_BUFFER_SIZE - r->len;
+
+      if (n > len) {
+        n = len;
+      }
+      if (flags & 1) {
+        if (fread(r->buf + r->len, 1, n, in) != n) {
+          eprint(0, "Truncated trace: %s", argv[optind]);
+          ret = 1;
+          goto exit;
+        }
+      } else {
+        size_t i = 0;
+        for (i = 0; i < n; i++) {
+          r->buf[r->len + i] = filler[fill++ % (sizeof(filler) - 1)];
+        }
+      }
+      r->len += n;
+      len -= n;
+      if (r->len == INPUT_BUFFER_SIZE && replay_flush(r) != 0) {
+        goto write_failed;
+      }
+    }
+    if (newline) {
+      r->buf[r->len++] = '\n';
+      if (r->len == INPUT_BUFFER_SIZE && replay_flush(r) != 0) {
+        goto write_failed;
+      }
+    }
+    r->lines++;
+  }
+  if (replay_flush(r) != 0) {
+    goto write_failed;
+  }
+  goto report;
+
+write_failed: {
+    int err = errno;
+    eprint(err, "Failed to write output%s", "");
+    ret = 1;
+  }
+
+  /* Report even if the consumer failed, as its failure is what is being tested */
+report:
+  fprintf(stderr, "Replayed %llu lines, %llu bytes in %.3f s (recorded %.3f s", r->lines, r->bytes,
+          (monotonic_ns() - start_ns) / 1e9, recorded_us / 1e6);
+  if (speed > 0) {
+    fprintf(stderr, ", replayed at %gx, at most %.6f s behind", speed, r->max_lag_ns / 1e9);
+  }
+  fprintf(stderr, ")\n");
+  fprintf(stderr, "Blocked writing for %.3f s in %llu writes, %llu of them for %d ms or more\n",
+          r->blocked_ns / 1e9, r->writes, r->stalls, REPLAY_STALL_NS / 1000000);
+  fprintf(stderr, "Write latency p50 %.6f s, p99 %.6f s, p99.9 %.6f s, max %.6f s\n",
+          histogram_quantile(&r->write_latency, 0.5) / 1e9, histogram_quantile(&r->write_latency, 0.99) / 1e9,
+          histogram_quantile(&r->write_latency, 0.999) / 1e9, r->write_latency.max / 1e9);
+
+exit:
+  if (in) {
+    fclose(in);
+  }
+  if (r) {
+    free(r->buf);
+  }
+  free(r);
+  return ret;
+}
+
+/* Line flags in a line batch */
+#define LINE_SAMPLED  (1)  /* the clocks were sampled for this line */
+#define LINE_LONG     (2)  /* only the prefix was rendered, the line is written from the input */
+
+/* Descriptors of a run of whole lines, as parallel arrays rather than a struct per line, so
+ * that each pass over the lines (indexing, stamping, rendering) touches only what it needs */
+struct line_batch {
+  size_t count;
+  unsigned int offsets[LINE_BATCH_LINES];  /* start of the line in the input */
+  unsigned int lengths[LINE_BATCH_LINES];  /* including the newline */
+  unsigned int ends[LINE_BATCH_LINES];     /* end of the prefixed line in the rendered output */
+  unsigned char flags[LINE_BATCH_LINES];
+  struct timespec realtime[LINE_BATCH_LINES];
+  struct timespec monotonic[LINE_BATCH_LINES];
+};
+
+/* Describe the whole lines at the start of data, at most max_lines of them.  Returns the bytes
+ * they take. */
+size_t line_batch_index(struct line_batch* b, const char* data, size_t len, size_t max_lines) {
+  const char* end = data + len;
+  const char* p = data;
+  const char* nl = NULL;
+  size_t n = 0;
+
+  if (max_lines > LINE_BATCH_LINES) {
+    max_lines = LINE_BATCH_LINES;
+  }
+  while (n < max_lines && (nl = memchr(p, '\n', end - p)) != NULL) {
+    b->offsets[n] = p - data;
+    b->lengths[n] = nl + 1 - p;
+    p = nl + 1;
+    n++;
+  }
+  b->count = n;
+  return p - data;
+}
+
+/* Sample the clocks into v for each line, or with batch_usec, when the batch sample gets too
+ * old, keeping the time of each line and flagging those sampled */
+void line_batch_stamp(struct line_batch* b, struct prefix_template* t, struct prefix_values* v, int* check,
+                      long long batch_usec) {
+  size_t i = 0;
+
+  for (i = 0; i < b->count; i++) {
+    if (!batch_usec) {
+      prefix_sample(t, v);
+      b->flags[i] = LINE_SAMPLED;
+    } else {
+      struct timespec last = v->monotonic;
+      prefix_sample_batch(t, v, check, batch_usec);
+      b->flags[i] = (v->monotonic.tv_sec != last.tv_sec || v->monotonic.tv_nsec != last.tv_nsec) ? LINE_SAMPLED : 0;
     }
+    b->realtime[i] = v->realtime;
+    b->monotonic[i] = v->monotonic;
   }
+}
 
-  /* Rotate log files */
-  for (i = max_files-1; i > 0; i--) {
-    sprintf(dst_file, "%s.%d", filename, i);
-    if (i == 1) {
-      strcpy(src_file, filename);
-    } else {
-      sprintf(src_file, "%s.%d", filename, i-1);
+/* Render the lines of the batch from first on into out, each after its prefix, while they fit
+ * in size bytes, recording where each ends.  A line too long to fit even alone gets only its
+ * prefix, and is flagged LINE_LONG.  Returns the index after the last line rendered, with the
+ * length rendered in *out_len. */
+size_t line_batch_render(struct line_batch* b, size_t first, const char* data, struct prefix_template* t,
+                         struct prefix_values* v, char* out, size_t size, size_t* out_len) {
+  size_t i = first, o = 0;
+
+  for (i = first; i < b->count; i++) {
+    int fits = (o + MAX_PREFIX_RENDERED_LENGTH + b->lengths[i] <= size);
+
+    if (!fits && i > first) {
+      break;
     }
+    if (b->flags[i] & LINE_SAMPLED) {
+      v->batch = 0;
+      t->cache_valid = 0;
+    }
+    v->realtime = b->realtime[i];
+    v->monotonic = b->monotonic[i];
+    v->seq++;
+    v->line++;
+    o += prefix_render(t, v, out + o);
+    v->batch++;
+    if (!fits) {
+      b->flags[i] |= LINE_LONG;
+      b->ends[i] = o;
+      i++;
+      break;
+    }
+    memcpy(out + o, data + b->offsets[i], b->lengths[i]);
+    o += b->lengths[i];
+    b->ends[i] = o;
+  }
+  *out_len = o;
+  return i;
+}
 
-    if (stat(src_file, &sb) == 0) {
-      if (rename(src_file, dst_file) != 0) {
-        int err = errno;
-        eprint(err, "Failed to rename log file: %s -> %s", src_file, dst_file);
-        return 1;
+/* Variants of the line loop in main(), each specialized for a common set of options so that
+ * writing a line tests none of them.  JSON, binary records, field extraction and -E, as well
+ * as partial lines and rotation, take the general loop. */
+enum write_variant {
+  WRITE_GENERAL = 0,
+  WRITE_PLAIN,             /* lines as they are */
+  WRITE_PLAIN_LIMITED,     /* lines as they are, with a line limit */
+  WRITE_PREFIXED,          /* each line after a prefix sampled for it */
+  WRITE_PREFIXED_LIMITED,
+  WRITE_BATCHED,           /* each line after a prefix from a -B batch sample */
+  WRITE_BATCHED_LIMITED
+};
+
+/* Write the whole lines at the start of data to file, at most room of them if limited, each
+ * after a prefix rendered from t and v if prefixed, a line batch b at a time through out.
+ * Returns the bytes written, counting the lines in *lines, or on a write error sets *failed and
+ * returns only the lines written in full.  Inlined with constant flags, so each variant is
+ * compiled without the tests for the others. */
+static inline __attribute__((always_inline))
+size_t write_lines(FILE* file, const char* data, size_t len, const int limited, unsigned long long room,
+                   const int prefixed, const int batched, struct prefix_template* t, struct prefix_values* v,
+                   int* batch_check, long long batch_usec, struct line_batch* b, char* out,
+                   unsigned long long* lines, int* failed) {
+  const char* end = data + len;
+  const char* p = data;
+  unsigned long long n = 0;
+
+  if (!prefixed) {
+    /* Find the end of the last whole line, then write them all at once */
+    const char* nl = NULL;
+    size_t written = 0;
+
+    while ((!limited || n < room) && (nl = memchr(p, '\n', end - p)) != NULL) {
+      p = nl + 1;
+      n++;
+    }
+    if (p > data && (written = fwrite(data, 1, p - data, file)) != (size_t)(p - data)) {
+      *failed = 1;
+      for (p = data, n = 0; (nl = memchr(p, '\n', data + written - p)) != NULL; n++) {
+        p = nl + 1;
       }
     }
+    *lines = n;
+    return p - data;
   }
 
-  /* Open new log file */
-  *file = fopen(filename, "a");
-  if (!*file) {
-      int err = errno;
-      eprint(err, "Failed to open new log file for writing: %s", filename);
-      return 1;
-  }
+  /* Index, stamp and render each run of lines in passes, then write it at once */
+  while (!limited || n < room) {
+    unsigned long long batch = v->batch;
+    size_t consumed = line_batch_index(b, p, end - p, limited ? room - n : LINE_BATCH_LINES);
+    size_t i = 0, next = 0;
 
-  return 0;
+    if (b->count == 0) {
+      break;
+    }
+    line_batch_stamp(b, t, v, batch_check, batched ? batch_usec : 0);
+    v->batch = batch;
+    for (i = 0; i < b->count; i = next) {
+      size_t out_len = 0, written = 0;
+      int long_failed = 0;
+
+      next = line_batch_render(b, i, p, t, v, out, LINE_BATCH_OUT_SIZE, &out_len);
+      written = fwrite(out, 1, out_len, file);
+      if (written == out_len && (b->flags[next - 1] & LINE_LONG)) {
+        long_failed = fwrite(p + b->offsets[next - 1], 1, b->lengths[next - 1], file) != b->lengths[next - 1];
+      }
+      if (written != out_len || long_failed) {
+        /* Keep only the lines written in full, so the rest are written after rotating */
+        while (i < next && b->ends[i] <= written && !(b->flags[i] & LINE_LONG)) {
+          i++;
+        }
+        *failed = 1;
+        *lines = n + i;
+        return p + b->offsets[i] - data;
+      }
+      *batch_check = BATCH_CHECK_LINES - 1;  /* the write may have blocked, so check the sample */
+    }
+    p += consumed;
+    n += b->count;
+  }
+  *lines = n;
+  return p - data;
 }
 
+#ifndef LUMBERJACK_NO_MAIN  /* defined by bench/micro.c, which includes this file */
 int main(int argc, char** argv) {
   const char* filename = DEFAULT_OUTPUT_LOG_FILENAME;
   const char* in_filename = NULL;
@@ -117,6 +4983,11 @@ int main(int argc, char** argv) {
   int do_append = 0;
   int do_timestamp = 0;
   int do_epochstamp = 0;
+  int do_sanitize = 0;
+  int do_json = 0;
+  int do_binary = 0;
+  int do_embedded = 0;
+  const char* src_tag = NULL;
 
   int ret = 0;
   int c = 0;
@@ -126,9 +4997,77 @@ int main(int argc, char** argv) {
   int is_newline = 1;
   int line_count = 0;
   int write_error = 0;
+  char* in_buf = NULL;
+  char* sanitize_buf = NULL;
+  char* data = NULL;
+  size_t len = 0;
+  enum sanitize_state sanitize_state = SANITIZE_TEXT;
+  struct utf8_state utf8_state = {0};
+  char* utf8_buf = NULL;
+  char* json_buf = NULL;
+  char* json_src = NULL;
+  struct line_batch* line_batch = NULL;
+  char* line_out = NULL;
+  const char* prefix_text = NULL;
+  char template[MAX_PREFIX_LENGTH];
+  struct prefix_template prefix = {0};
+  struct prefix_values prefix_values = {0};
+  struct prefix_values line_values = {0};
+  struct line_time_parser line_time = {-1, 0};
+  char prefix_buf[MAX_PREFIX_RENDERED_LENGTH];
+  long long batch_usec = 0;
+  int batch_check = 0;
+  unsigned long long seq = 0;
+  struct field_extractor fields = {0};
+  int fields_started = 0;
+  struct archiver archive = {0};
+  int archive_started = 0;
+  struct binary_log binary = {0};
+  const char* metrics_filename = NULL;
+  struct metrics metrics = {0};
+  struct sigaction metrics_action = {0};
+  struct itimerval metrics_timer = {{0}, {0}};
+  sigset_t metrics_signals, old_signals;
+  long long block_ns = 0;
+  long long read_ns = 0;
+  unsigned long long block_seq = 0;
+  unsigned long long block_written = 0;
+  long long flush_ns = 0;
+  long long now_ns = 0;
+  int do_sync = 0;
+  int do_perf = 0;
+  const char* trace_filename = NULL;
+  long long span_ns = 0;
+  struct perf_counters perf = {{-1, -1, -1, -1}, {0}, {{0}}};
+  enum cpu_level cpu_level = CPU_BASELINE;
+  enum write_variant variant = WRITE_GENERAL;
+
+  /* Use the default kernel variants for this CPU */
+  cpu_level = cpu_detect();
+  cpu_dispatch(cpu_default(cpu_level));
+
+  /* Subcommands */
+  if (argc > 1 && strcmp(argv[1], "fields") == 0) {
+    return fields_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "cat") == 0) {
+    return cat_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "merge") == 0) {
+    return merge_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "tac") == 0) {
+    return tac_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "record") == 0) {
+    return record_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "replay") == 0) {
+    return replay_main(argc - 1, argv + 1);
+  }
 
   while(c != -1) {
-    c = getopt(argc, argv, "adf:hi:l:n:t");
+    c = getopt(argc, argv, "aA:bB:C:dD:Ef:hHi:jl:M:n:p:PstT:u:x:y");
     switch (c) {
       case -1:
         break;
@@ -137,10 +5076,51 @@ int main(int argc, char** argv) {
         do_append = 1;
         break;
 
+      case 'A':
+        archive.dir = optarg;
+        break;
+
+      case 'b':
+        do_binary = 1;
+        break;
+
+      case 'B':
+        if (strspn(optarg, "0123456789") == strlen(optarg)) {
+            batch_usec = atoll(optarg);
+        }
+        if (batch_usec <= 0) {
+            eprint(0, "Invalid batch stamp age: %s\n", optarg);
+            print_usage(argv[0]);
+            return 1;
+        }
+        break;
+
+      case 'C': {
+        int level = 0;
+        while (level < CPU_LEVELS && strcmp(optarg, cpu_level_names[level]) != 0) {
+          level++;
+        }
+        if (level == CPU_LEVELS || level > (int)cpu_level) {
+            eprint(0, "Invalid or unsupported CPU level: %s\n", optarg);
+            print_usage(argv[0]);
+            return 1;
+        }
+        cpu_dispatch((enum cpu_level)level);
+        break;
+      }
+
       case 'd':
         do_timestamp = 1;
         break;
 
+      case 'D':
+        trace_filename = optarg;
+        break;
+
+      case 'E':
+        do_embedded = 1;
+        break;
+
       case 'f':
         filename = optarg;
         if (!filename || !strlen(filename)) {
@@ -154,10 +5134,18 @@ int main(int argc, char** argv) {
         print_usage(argv[0]);
         return 0;
 
+      case 'H':
+        fields.huge_pages = 1;
+        break;
+
       case 'i':
         in_filename = optarg;
         break;
 
+      case 'j':
+        do_json = 1;
+        break;
+
       case 'l':
         if (strspn(optarg, "0123456789") == strlen(optarg)) {
             max_lines = atoi(optarg);
@@ -168,6 +5156,10 @@ int main(int argc, char** argv) {
         }
         break;
 
+      case 'M':
+        metrics_filename = optarg;
+        break;
+
       case 'n':
         max_files = 0;
         if (strspn(optarg, "0123456789") == strlen(optarg)) {
@@ -180,10 +5172,54 @@ int main(int argc, char** argv) {
         }
         break;
 
+      case 'p':
+        prefix_text = optarg;
+        break;
+
+      case 'P':
+        do_perf = 1;
+        break;
+
+      case 's':
+        do_sanitize = 1;
+        break;
+
       case 't':
         do_epochstamp = 1;
         break;
 
+      case 'T':
+        src_tag = optarg;
+        break;
+
+      case 'u':
+        if (strcmp(optarg, "replace") == 0) {
+            utf8_state.mode = UTF8_REPLACE;
+        } else if (strcmp(optarg, "escape") == 0) {
+            utf8_state.mode = UTF8_ESCAPE;
+        } else {
+            eprint(0, "Invalid UTF-8 repair mode: %s\n", optarg);
+            print_usage(argv[0]);
+            return 1;
+        }
+        break;
+
+      case 'x':
+        if (strcmp(optarg, "logfmt") == 0) {
+            fields.format = FIELDS_LOGFMT;
+        } else if (strcmp(optarg, "json") == 0) {
+            fields.format = FIELDS_JSON;
+        } else {
+            eprint(0, "Invalid field format: %s\n", optarg);
+            print_usage(argv[0]);
+            return 1;
+        }
+        break;
+
+      case 'y':
+        do_sync = 1;
+        break;
+
       case '?':
         /* In this case, an option was provided that requires an argument, but no argument
          * was given.  Since getopt() will print an error, just add usage information. */
@@ -196,11 +5232,57 @@ int main(int argc, char** argv) {
     }
   }
 
+  /* Binary records are not text, so cannot also be JSON or archived */
+  if (do_binary && (do_json || archive.dir)) {
+      eprint(0, "Binary output cannot be combined with JSON output or archiving%s", "");
+      return 1;
+  }
+  if (prefix_text && (do_binary || do_json)) {
+      eprint(0, "A prefix template cannot be used with binary or JSON output%s", "");
+      return 1;
+  }
+
+  /* JSON strings must be valid UTF-8, so JSON output repairs it unless -u chose how */
+  if (do_json && utf8_state.mode == UTF8_OFF) {
+    utf8_state.mode = UTF8_REPLACE;
+  }
+
   /* Check filename to ensure it is short enough for internal string buffers */
-  if (snprintf(ts_str, sizeof(ts_str), "%s.%d", filename, max_files-1) >= MAX_FILENAME_LENGTH) {
+  if (snprintf(ts_str, sizeof(ts_str), "%s.%d" FIELDS_SUFFIX, filename, max_files-1) >= MAX_FILENAME_LENGTH) {
       eprint(0, "Filename too long%s", "");
       return 1;
   }
+  if (metrics_filename && strlen(metrics_filename) > MAX_FILENAME_LENGTH) {
+      eprint(0, "Metrics filename too long%s", "");
+      return 1;
+  }
+
+#ifdef LUMBERJACK_FAULTS
+  /* Test builds inject the I/O faults described by LUMBERJACK_FAULTS */
+  if (fault_init() != 0) {
+    eprint(0, "Invalid LUMBERJACK_FAULTS: %s", getenv("LUMBERJACK_FAULTS"));
+    return 1;
+  }
+#endif
+
+  /* Dump metrics on SIGUSR1, and with -M, save them periodically on SIGALRM.  The handlers
+   * interrupt read() rather than restarting it, and only the main thread takes the signals. */
+  metrics.start = time(NULL);
+  metrics_action.sa_handler = metrics_signal;
+  sigemptyset(&metrics_action.sa_mask);
+  sigaction(SIGUSR1, &metrics_action, NULL);
+  sigaction(SIGALRM, &metrics_action, NULL);
+  sigemptyset(&metrics_signals);
+  sigaddset(&metrics_signals, SIGUSR1);
+  sigaddset(&metrics_signals, SIGALRM);
+  pthread_sigmask(SIG_BLOCK, &metrics_signals, &old_signals);
+
+  /* If enabled, record trace spans from every thread */
+  if (trace_filename && trace_start() != 0) {
+    eprint(0, "Failed to allocate trace buffers%s", "");
+    ret = 1;
+    goto exit;
+  }
 
   /* Open input file if provided */
   if (in_filename && strlen(in_filename)) {
@@ -213,10 +5295,28 @@ int main(int argc, char** argv) {
     }
   }
 
+  /* If enabled, start archiving retired log files */
+  if (archive.dir) {
+    if (archive_start(&archive, filename) != 0) {
+      ret = 1;
+      goto exit;
+    }
+    archive_started = 1;
+  }
+
   /* Initialize the log file */
-  if (do_append) {
+  if (do_append && do_binary) {
+    /* Open log file, counting its records and continuing its timestamps and sequence */
+    file_out = log_fopen(filename, "a+");
+    if (!file_out || binary_resume(file_out, &binary, &line_count, &seq) != 0) {
+      int err = file_out ? 0 : errno;
+      eprint(err, "Failed to open binary log file for append: %s", filename);
+      ret = 1;
+      goto exit;
+    }
+  } else if (do_append) {
     /* Open log file */
-    file_out = fopen(filename, "a+");
+    file_out = log_fopen(filename, "a+");
     if (!file_out) {
       int err = errno;
       eprint(err, "Failed to open log file for append: %s", filename);
@@ -250,95 +5350,517 @@ int main(int argc, char** argv) {
       if (fflush(file_out) != 0) {
         int err = errno;
         wprint(err, "Failed to flush output after newline%s", "");
+        PROBE1(write__error, err);
+        write_error = 1;
       }
     }
   } else {
     /* Initially rotate log to open log file and ensure log is new */
-    if(rotate_log(&file_out, filename, max_files) != 0) {
+    if(retire_log(&file_out, filename, max_files, archive_started ? &archive : NULL) != 0) {
       eprint(0, "Failed to initially rotate log%s", "");
       ret = 1;
       goto exit;
     }
+    if (do_binary && binary_start(file_out, &binary, seq) != 0) {
+      int err = errno;
+      eprint(err, "Failed to write binary log file header%s", "");
+      ret = 1;
+      goto exit;
+    }
+  }
+
+  /* If enabled, start extracting fields into sidecar files alongside the log files */
+  if (fields.format != FIELDS_OFF) {
+    fields.filename = filename;
+    fields.max_files = max_files;
+    if (field_start(&fields, do_append, line_count) != 0) {
+      ret = 1;
+      goto exit;
+    }
+    fields_started = 1;
+  }
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+  metrics.out_pos = ftello(file_out);
+
+  /* If enabled, count hardware events of the main loop from here on */
+  if (do_perf && perf_start(&perf) == 0) {
+    metrics.perf = &perf;
+  }
+  if (metrics_filename) {
+    metrics_timer.it_interval.tv_sec = METRICS_INTERVAL;
+    metrics_timer.it_value.tv_sec = METRICS_INTERVAL;
+    setitimer(ITIMER_REAL, &metrics_timer, NULL);
+  }
+
+  /* Allocate input buffers */
+  in_buf = malloc(INPUT_BUFFER_SIZE);
+  if (do_binary) {
+    binary.record = malloc(MAX_RECORD_LENGTH);
+  }
+  if (do_sanitize) {
+    sanitize_buf = malloc(MAX_SANITIZE_EXPANSION * INPUT_BUFFER_SIZE);
+  }
+  if (utf8_state.mode != UTF8_OFF) {
+    size_t max_in = (do_sanitize ? MAX_SANITIZE_EXPANSION : 1) * INPUT_BUFFER_SIZE;
+    utf8_buf = malloc(MAX_UTF8_EXPANSION * (max_in + MAX_UTF8_PENDING));
+  }
+  if (!src_tag) {
+    src_tag = (in_filename && strlen(in_filename)) ? in_filename : "stdin";
+  }
+  if (do_json) {
+    json_buf = malloc(MAX_JSON_EXPANSION * JSON_ESCAPE_CHUNK);
+    json_src = malloc(MAX_JSON_EXPANSION * strlen(src_tag) + 1);
+    if (json_src) {
+      json_src[json_escape(src_tag, strlen(src_tag), json_src)] = '\0';
+    }
+  }
+  if (!in_buf || (do_binary && !binary.record) || (do_sanitize && !sanitize_buf) || (utf8_state.mode != UTF8_OFF && !utf8_buf) ||
+      (do_json && (!json_buf || !json_src))) {
+    eprint(0, "Failed to allocate input buffers%s", "");
+    ret = 1;
+    goto exit;
+  }
+
+  /* Compile the line prefix, which for JSON output is the start of each record */
+  template[0] = '\0';
+  if (do_json) {
+    ret |= prefix_append(template, sizeof(template), "{\"ts\":%e,\"seq\":%s,\"src\":\"", 0);
+    ret |= prefix_append(template, sizeof(template), json_src, 1);
+    ret |= prefix_append(template, sizeof(template), "\"", 0);
+    if (do_timestamp) {
+      ret |= prefix_append(template, sizeof(template), ",\"date\":\"%d\"", 0);
+    }
+    if (do_epochstamp) {
+      ret |= prefix_append(template, sizeof(template), ",\"mono\":%m", 0);
+    }
+    ret |= prefix_append(template, sizeof(template), ",\"msg\":\"", 0);
+  } else {
+    if (do_timestamp) {
+      ret |= prefix_append(template, sizeof(template), "[%d]: ", 0);
+    }
+    if (do_epochstamp) {
+      ret |= prefix_append(template, sizeof(template), "[%m]: ", 0);
+    }
+    if (prefix_text) {
+      ret |= prefix_append(template, sizeof(template), prefix_text, 0);
+    }
+  }
+  if (ret != 0 || prefix_compile(&prefix, template, src_tag) != 0) {
+    eprint(0, "Invalid or too long prefix template: %s", template);
+    ret = 1;
+    goto exit;
+  }
+  prefix.batched = (batch_usec != 0);
+  if (do_embedded && prefix.needs_realtime) {
+    prefix.per_line = 1;  /* the time may differ on every line */
+  }
+
+  /* Choose the variant of the line loop for the options, once */
+  if (!do_binary && !do_json && !do_embedded && !fields_started) {
+    variant = !prefix.op_count ? WRITE_PLAIN : batch_usec ? WRITE_BATCHED : WRITE_PREFIXED;
+    variant += (max_lines != 0);
+  }
+  if (variant >= WRITE_PREFIXED) {
+    line_batch = malloc(sizeof(*line_batch));
+    line_out = malloc(LINE_BATCH_OUT_SIZE);
+    if (!line_batch || !line_out) {
+      eprint(0, "Failed to allocate line batch buffers%s", "");
+      ret = 1;
+      goto exit;
+    }
   }
 
   /* Read and output to log, rotating log files as necessary */
   while (ret == 0) {
-    /* If a new log file failed to write, consider this a fatal error */
-    if (write_error && is_newline && (line_count == 0)) {
-      eprint(0, "Failed to write new log file%s", "");
+    ssize_t in_len = 0;
+
+    read_ns = monotonic_ns();
+    in_len = read(fileno(file_in), in_buf, INPUT_BUFFER_SIZE);
+    perf_mark(&perf, PERF_READ);
+    block_ns = monotonic_ns();
+    read_ns = block_ns - read_ns;
+    metrics.read_ns += read_ns;
+    PROBE2(read, in_len, read_ns);
+    trace_span(TRACE_MAIN, "read", block_ns - read_ns);
+
+    /* Write metrics if requested by a signal */
+    if (metrics_dump_requested || metrics_save_requested) {
+      metrics.lines = seq;
+      metrics.log_lines = line_count;
+      metrics.field_drops = fields.dropped;
+      metrics.archive_drops = archive.dropped;
+      if (metrics_dump_requested) {
+        metrics_dump_requested = 0;
+        metrics_write(&metrics, stderr);
+      }
+      if (metrics_save_requested && metrics_filename) {
+        metrics_save_requested = 0;
+        if (metrics_save(&metrics, metrics_filename) != 0) {
+          int err = errno;
+          wprint(err, "Failed to save metrics: %s", metrics_filename);
+        }
+      }
+    }
+
+    if (in_len < 0) {
+      int err = errno;
+      if (err == EINTR) {
+        continue;
+      }
+      eprint(err, "Failed to read input%s", "");
       ret = 1;
       goto exit;
     }
-
-    /* Get next input character if previous character was written */
-    if (!write_error) {
-      c = fgetc(file_in);
-      if (c == EOF) {
-        /* End of input */
+    data = in_buf;
+    len = in_len;
+    metrics.reads++;
+    metrics.read_bytes += len;
+    metrics.buffered = len;
+    block_seq = seq;
+    block_written = metrics.written_bytes;
+    if (len == 0) {
+      /* End of input, but an incomplete UTF-8 sequence may still need to be repaired */
+      if (utf8_state.pending_len == 0) {
         break;
       }
     }
 
-    /* If write error or log reached the line limit, then rotate logs */
-    if (write_error || (is_newline && (max_lines != 0) && (line_count >= max_lines))) {
-      if(rotate_log(&file_out, filename, max_files) != 0) {
-        eprint(0, "Failed to rotate log%s", "");
+    /* If enabled, sanitize the block; clean blocks are passed through without copying */
+    span_ns = trace_now();
+    if (do_sanitize && (sanitize_state != SANITIZE_TEXT || find_control(data, len) != len)) {
+      len = sanitize_block(&sanitize_state, data, len, sanitize_buf);
+      data = sanitize_buf;
+    }
+
+    /* If enabled, repair invalid UTF-8; valid blocks are passed through without copying */
+    if (utf8_state.mode != UTF8_OFF && (utf8_state.pending_len != 0 || utf8_valid_prefix(data, len) != len)) {
+      len = utf8_repair_block(&utf8_state, data, len, utf8_buf);
+      data = utf8_buf;
+    }
+
+    perf_mark(&perf, PERF_SCAN);
+    if (do_sanitize || utf8_state.mode != UTF8_OFF) {
+      trace_span(TRACE_MAIN, "scan", span_ns);
+    }
+    span_ns = trace_now();
+
+    /* If enabled, take one clock sample to stamp all lines of the block */
+    if (batch_usec) {
+      prefix_sample(&prefix, &prefix_values);
+      batch_check = 0;
+    }
+
+    /* Output the block a line at a time */
+    while (len > 0 || binary.record_ready) {
+      char* nl = NULL;
+      size_t seg_len = 0, pending = 0;
+
+      /* If a new log file failed to write, consider this a fatal error */
+      if (write_error && is_newline && (line_count == 0)) {
+        eprint(0, "Failed to write new log file%s", "");
         ret = 1;
         goto exit;
       }
-      write_error = 0;
-      line_count = 0;
-    }
 
-    /* If enabled, prefix a local timestamp on the line */
-    if (do_timestamp && is_newline) {
-        struct timespec ts = {0};
-        clock_gettime(CLOCK_REALTIME, &ts);
-        struct tm *dt = localtime(&(ts.tv_sec));
-        snprintf(ts_str, sizeof(ts_str), "[%d-%02d-%02d %02d:%02d:%02d.%06ld]: ",
-                dt->tm_year+1900, dt->tm_mon+1, dt->tm_mday,
-                dt->tm_hour, dt->tm_min, dt->tm_sec, ts.tv_nsec/1000);
-        if(fputs(ts_str, file_out) < 0) {
+      /* If write error or log reached the line limit, then rotate logs */
+      if (write_error || (is_newline && (max_lines != 0) && (line_count >= max_lines))) {
+        long long rotation_ns = monotonic_ns();
+
+        perf_mark(&perf, PERF_WRITE);
+        metrics_output(&metrics, file_out);
+        PROBE2(rotate__start, line_count, metrics.out_pos);
+        if(retire_log(&file_out, filename, max_files, archive_started ? &archive : NULL) != 0) {
+          eprint(0, "Failed to rotate log%s", "");
+          ret = 1;
+          goto exit;
+        }
+        now_ns = monotonic_ns();
+        rotation_ns = now_ns - rotation_ns;
+        metrics.rotations++;
+        metrics.rotation_ns += rotation_ns;
+        histogram_record(&metrics.rotation, rotation_ns);
+        trace_span(TRACE_MAIN, "rotate", now_ns - rotation_ns);
+        PROBE2(rotate__done, metrics.rotations, rotation_ns);
+        if (rotation_ns > metrics.rotation_max_ns) {
+          metrics.rotation_max_ns = rotation_ns;
+        }
+        metrics.write_errors += write_error;
+        metrics.out_pos = 0;
+        write_error = 0;
+        line_count = 0;
+        batch_check = BATCH_CHECK_LINES - 1;  /* rotating may block, so check the clock sample */
+        if (fields_started) {
+          field_rotate(&fields);
+        }
+        if (do_binary && binary_start(file_out, &binary, seq) != 0) {
           int err = errno;
-          wprint(err, "Failed to write datetime stamp: %s", ts_str);
+          wprint(err, "Failed to write binary log file header%s", "");
+          PROBE1(write__error, err);
           write_error = 1;
           continue;
         }
-    }
 
-    /* If enabled, prefix a epoch timestamp on the line */
-    if (do_epochstamp && is_newline) {
-        struct timespec ts = {0};
-        clock_gettime(CLOCK_MONOTONIC, &ts);
-        snprintf(ts_str, sizeof(ts_str), "[%ld.%06ld]: ", ts.tv_sec, ts.tv_nsec/1000);
-        if(fputs(ts_str, file_out) < 0) {
+        perf_mark(&perf, PERF_ROTATE);
+
+        /* Start a new JSON record for the rest of a line, so every file stays valid */
+        if (do_json && !is_newline) {
+          is_newline = 1;
+          seq--;
+        }
+      }
+
+      /* Write whole lines with the variant of the loop for the options, leaving any partial
+       * line at the end of the block to the general loop below */
+      if (variant != WRITE_GENERAL && is_newline) {
+        unsigned long long room = max_lines - line_count, lines = 0;
+
+#define WRITE_LINES(limited, prefixed, batched) \
+        write_lines(file_out, data, len, limited, room, prefixed, batched, &prefix, &prefix_values, \
+                    &batch_check, batch_usec, line_batch, line_out, &lines, &write_error)
+        prefix_values.seq = seq;
+        prefix_values.line = line_count;
+        switch (variant) {
+          case WRITE_PLAIN:            seg_len = WRITE_LINES(0, 0, 0); break;
+          case WRITE_PLAIN_LIMITED:    seg_len = WRITE_LINES(1, 0, 0); break;
+          case WRITE_PREFIXED:         seg_len = WRITE_LINES(0, 1, 0); break;
+          case WRITE_PREFIXED_LIMITED: seg_len = WRITE_LINES(1, 1, 0); break;
+          case WRITE_BATCHED:          seg_len = WRITE_LINES(0, 1, 1); break;
+          case WRITE_BATCHED_LIMITED:  seg_len = WRITE_LINES(1, 1, 1); break;
+          default:                     break;
+        }
+#undef WRITE_LINES
+        data += seg_len;
+        len -= seg_len;
+        seq += lines;
+        line_count += lines;
+        if (write_error) {
+          int err = errno;
+          wprint(err, "Failed to write line%s", "");
+          PROBE1(write__error, err);
+          continue;
+        }
+        if (seg_len > 0) {
+          continue;
+        }
+      }
+
+      /* If enabled, collect the line and write it as a binary record once complete, with the
+       * time it started kept in the record rather than rendered */
+      if (do_binary) {
+        if (!binary.record_ready) {
+          nl = memchr(data, '\n', len);
+          seg_len = nl ? (size_t)(nl - data) : len;
+          if (seg_len > MAX_RECORD_LENGTH - binary.record_len) {
+            seg_len = MAX_RECORD_LENGTH - binary.record_len;
+            nl = NULL;
+          }
+          if (binary.record_len == 0 && is_newline) {
+            if (batch_usec) {
+              prefix_sample_batch(&prefix, &prefix_values, &batch_check, batch_usec);
+              binary.record_us = (long long)prefix_values.realtime.tv_sec * 1000000 +
+                                 prefix_values.realtime.tv_nsec / 1000;
+            } else {
+              binary.record_us = realtime_us();
+            }
+          }
+          memcpy(binary.record + binary.record_len, data, seg_len);
+          binary.record_len += seg_len;
+          binary.record_complete = (nl != NULL);
+          binary.record_ready = (nl != NULL) || (binary.record_len == MAX_RECORD_LENGTH);
+          if (fields_started) {
+            field_append(&fields, data, seg_len + (nl != NULL), nl != NULL);
+          }
+          data += seg_len + (nl != NULL);
+          len -= seg_len + (nl != NULL);
+          if (!binary.record_ready) {
+            continue;
+          }
+        }
+
+        if (do_embedded && is_newline) {
+          binary_embedded_time(&binary, &line_time);
+        }
+        pending = __fpending(file_out);
+        if (binary_write_record(file_out, &binary, seq + is_newline) != 0) {
+          int err = errno;
+          wprint(err, "Failed to write record%s", "");
+          PROBE1(write__error, err);
+          write_error = 1;
+          continue;
+        }
+        seq += is_newline;
+        is_newline = binary.record_complete;
+        line_count += is_newline;
+        if (stdio_wrote_out(file_out, pending, binary.record_len)) {
+          batch_check = BATCH_CHECK_LINES - 1;  /* the write may have blocked, so check the sample */
+        }
+        binary.record_len = 0;
+        binary.record_ready = 0;
+        binary.record_us = binary.last_us;
+        continue;
+      }
+
+      /* If enabled, prefix the line, or start its JSON record, from the compiled template */
+      pending = __fpending(file_out);
+      if (prefix.op_count && is_newline) {
+        size_t prefix_len = 0;
+
+        /* Sample the clocks for each line, or with batches, when the sample gets too old */
+        if (!batch_usec) {
+          prefix_sample(&prefix, &prefix_values);
+        } else {
+          prefix_sample_batch(&prefix, &prefix_values, &batch_check, batch_usec);
+        }
+        prefix_values.seq = seq + 1;
+        prefix_values.line = line_count + 1;
+        if (do_embedded && prefix.needs_realtime &&
+            parse_line_time(&line_time, data, len, &line_values.realtime) == 0) {
+          line_values.monotonic = prefix_values.monotonic;
+          line_values.seq = prefix_values.seq;
+          line_values.line = prefix_values.line;
+          line_values.batch = prefix_values.batch;
+          prefix_len = prefix_render(&prefix, &line_values, prefix_buf);
+        } else {
+          prefix_len = prefix_render(&prefix, &prefix_values, prefix_buf);
+        }
+        if (fwrite(prefix_buf, 1, prefix_len, file_out) != prefix_len) {
+          int err = errno;
+          wprint(err, "Failed to write line prefix%s", "");
+          PROBE1(write__error, err);
+          write_error = 1;
+          continue;
+        }
+        prefix_values.batch++;
+      }
+
+      /* Write up to and including the next newline to the log */
+      nl = memchr(data, '\n', len);
+      seg_len = nl ? (size_t)(nl - data) + 1 : len;
+      if (do_json) {
+        /* The newline itself ends the record */
+        if (fwrite_json_string(data, nl ? seg_len - 1 : seg_len, json_buf, file_out) != 0 ||
+            (nl && fputs("\"}\n", file_out) < 0)) {
           int err = errno;
-          wprint(err, "Failed to write epoch stamp: %s", ts_str);
+          wprint(err, "Failed to write JSON record%s", "");
+          PROBE1(write__error, err);
           write_error = 1;
           continue;
         }
+      } else if (fwrite(data, 1, seg_len, file_out) != seg_len) {
+        int err = errno;
+        wprint(err, "Failed to write line%s", "");
+        PROBE1(write__error, err);
+        write_error = 1;
+        continue;
+      }
+      if (fields_started) {
+        field_append(&fields, data, seg_len, nl != NULL);
+      }
+      if (stdio_wrote_out(file_out, pending, seg_len)) {
+        batch_check = BATCH_CHECK_LINES - 1;  /* the write may have blocked, so check the sample */
+      }
+      data += seg_len;
+      len -= seg_len;
+      seq += is_newline;
+
+      /* Mark if the line was completed */
+      is_newline = (nl != NULL);
+      if (is_newline) {
+        line_count++;
+      }
     }
 
-    /* Write the character to the log */
-    if (fputc(c, file_out) == EOF) {
+    /* Flush once per block, so everything read is written before blocking on the next read */
+    perf_mark(&perf, PERF_WRITE);
+    trace_span(TRACE_MAIN, "write", span_ns);
+    flush_ns = monotonic_ns();
+    if (fflush(file_out) != 0) {
+      /* The buffered lines are lost, so count it as a write error and rotate before the next
+       * write, as for a failed line */
       int err = errno;
-      wprint(err, "Failed to write character%s", "");
+      wprint(err, "Failed to flush output%s", "");
+      PROBE1(write__error, err);
       write_error = 1;
-      continue;
     }
+    now_ns = monotonic_ns();
+    metrics.flushes++;
+    metrics_output(&metrics, file_out);
+    metrics.write_ns += now_ns - block_ns;
+    histogram_record(&metrics.flush, now_ns - flush_ns);
+    PROBE3(flush, metrics.written_bytes - block_written, seq - block_seq, now_ns - flush_ns);
+    histogram_record(&metrics.write_latency, now_ns - block_ns);
 
-    /* Mark if this was a newline character */
-    is_newline = (c == '\n');
-    if (is_newline) {
-      line_count++;
-      if (fflush(file_out) != 0) {
+    /* If enabled, make the block durable before reading the next */
+    if (do_sync) {
+      if (fdatasync(log_fileno(file_out)) != 0) {
         int err = errno;
-        wprint(err, "Failed to flush output after newline%s", "");
+        wprint(err, "Failed to sync output%s", "");
       }
+      histogram_record(&metrics.sync_latency, monotonic_ns() - block_ns);
+    }
+    perf_mark(&perf, PERF_FLUSH);
+    trace_span(TRACE_MAIN, "flush", flush_ns);
+    if (fields_started) {
+      span_ns = trace_now();
+      field_handoff(&fields);
+      trace_span(TRACE_MAIN, "enqueue", span_ns);
+    }
+  }
+
+  /* Write a final line without a newline */
+  if (do_binary && binary.record_len > 0) {
+    if (do_embedded && is_newline) {
+      binary_embedded_time(&binary, &line_time);
+    }
+    if (binary_write_record(file_out, &binary, seq + is_newline) != 0) {
+      int err = errno;
+      wprint(err, "Failed to write final record%s", "");
+    }
+  }
+
+  /* Close a JSON record left open by a final line without a newline */
+  if (do_json && !is_newline) {
+    if (fputs("\"}\n", file_out) < 0) {
+      int err = errno;
+      wprint(err, "Failed to end final JSON record%s", "");
+    }
+  }
+
+  /* Report hardware counts */
+  if (metrics.perf) {
+    perf_report(&perf, metrics.read_bytes, seq, stderr);
+  }
+
+  /* Save the final metrics */
+  if (metrics_filename) {
+    fflush(file_out);
+    metrics_output(&metrics, file_out);
+    metrics.lines = seq;
+    metrics.log_lines = line_count;
+    metrics.write_errors += write_error;  /* a write error not yet followed by a rotation */
+    metrics.field_drops = fields.dropped;
+    metrics.archive_drops = archive.dropped;
+    if (metrics_save(&metrics, metrics_filename) != 0) {
+      int err = errno;
+      wprint(err, "Failed to save metrics: %s", metrics_filename);
     }
   }
 
   exit:
+    perf_stop(&perf);
+    if (fields_started) {
+      field_stop(&fields);
+    }
+    if (archive_started) {
+      archive_stop(&archive);
+    }
+    if (tracing) {
+      if (trace_write(trace_filename) != 0) {
+        int err = errno;
+        wprint(err, "Failed to write trace: %s", trace_filename);
+      }
+      trace_stop();
+    }
     if(file_in) {
       if (fclose(file_in) != 0) {
         int err = errno;
@@ -351,6 +5873,19 @@ int main(int argc, char** argv) {
         wprint(err, "Failed to close output while exiting%s", "");
       }
     }
+#ifdef LUMBERJACK_FAULTS
+    if (faults.enabled) {
+      fault_report(stderr);
+    }
+#endif
+    free(in_buf);
+    free(sanitize_buf);
+    free(utf8_buf);
+    free(json_buf);
+    free(json_src);
+    free(line_batch);
+    free(line_out);
+    free(binary.record);
     return ret;
 }
-
+#endif